@@ -0,0 +1,373 @@
+#include "Bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+static bool overlaps(glm::vec2 lo0, glm::vec2 hi0, glm::vec2 lo1, glm::vec2 hi1)
+{
+    return lo0.x <= hi1.x && lo1.x <= hi0.x && lo0.y <= hi1.y && lo1.y <= hi0.y;
+}
+
+static double perimeter(glm::vec2 lo, glm::vec2 hi)
+{
+    return lo.x <= hi.x ? 2.0 * (double(hi.x - lo.x) + double(hi.y - lo.y)) : 0.0;
+}
+
+// Distance from p to the box, 0 inside
+static float distance(glm::vec2 p, glm::vec2 lo, glm::vec2 hi)
+{
+    glm::vec2 d = glm::max(glm::max(lo - p, p - hi), glm::vec2(0.0f));
+    return glm::length(d);
+}
+
+const size_t Bvh::LEAF_SIZE;
+const unsigned Bvh::NONE;
+
+Bvh::Bvh()
+{
+}
+
+Bvh::~Bvh()
+{
+    if (rebuilding.valid())
+        rebuilding.wait();
+}
+
+void Bvh::update(unsigned id, glm::vec2 lo, glm::vec2 hi)
+{
+    // New items overlap nothing until their box is set
+    if (boxes.size() <= id)
+    {
+        Box empty;
+        empty.lo = glm::vec2(std::numeric_limits<float>::max());
+        empty.hi = glm::vec2(-std::numeric_limits<float>::max());
+        boxes.resize(id + 1, empty);
+    }
+    boxes[id].lo = lo;
+    boxes[id].hi = hi;
+
+    if (rebuilding.valid())
+        updatedSince.push_back(id);
+
+    if (id < tree.leaves.size() && tree.leaves[id] != NONE)
+        refit(id);
+    else
+        addPending(id);
+}
+
+void Bvh::resize(size_t count)
+{
+    // The removed items stay in their leaves until the next rebuild, the queries skip them
+    if (count >= boxes.size())
+        return;
+    boxes.resize(count);
+
+    size_t n = 0;
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+        if (pending[i] < count)
+            pending[n++] = pending[i];
+        else
+            isPending[pending[i]] = false;
+    }
+    pending.resize(n);
+}
+
+void Bvh::addPending(unsigned id)
+{
+    if (isPending.size() <= id)
+        isPending.resize(id + 1, false);
+    if (isPending[id])
+        return;
+    isPending[id] = true;
+    pending.push_back(id);
+}
+
+void Bvh::refit(unsigned id)
+{
+    ++stats.refits;
+
+    // Recompute the boxes up from the leaf until one does not change
+    for (unsigned node = tree.leaves[id]; node != NONE; node = tree.parents[node])
+    {
+        Node& n = tree.nodes[node];
+        glm::vec2 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+        if (n.count)
+        {
+            for (unsigned i = n.first; i < n.first + n.count; ++i)
+            {
+                unsigned item = tree.items[i];
+                if (item >= boxes.size())
+                    continue;
+                lo = glm::min(lo, boxes[item].lo);
+                hi = glm::max(hi, boxes[item].hi);
+            }
+        }
+        else
+        {
+            const Node& left = tree.nodes[n.first];
+            const Node& right = tree.nodes[n.first + 1];
+            lo = glm::min(left.lo, right.lo);
+            hi = glm::max(left.hi, right.hi);
+        }
+
+        if (lo == n.lo && hi == n.hi)
+            break;
+        tree.cost += perimeter(lo, hi) - perimeter(n.lo, n.hi);
+        n.lo = lo;
+        n.hi = hi;
+    }
+}
+
+Bvh::Tree Bvh::build(std::vector<Box> boxes)
+{
+    Tree tree;
+    tree.leaves.assign(boxes.size(), NONE);
+    std::vector<Ref> refs;
+    for (size_t id = 0; id < boxes.size(); ++id)
+    {
+        if (boxes[id].lo.x > boxes[id].hi.x)
+            continue;
+        Ref ref;
+        ref.box = boxes[id];
+        ref.id = id;
+        refs.push_back(ref);
+    }
+    tree.count = refs.size();
+    if (refs.empty())
+        return tree;
+
+    tree.nodes.reserve(2 * (refs.size() / LEAF_SIZE + 1));
+    tree.nodes.push_back(Node());
+    tree.parents.push_back(NONE);
+    tree.items.resize(refs.size());
+    buildNode(tree, refs, 0, 0, refs.size());
+
+    for (size_t node = 0; node < tree.nodes.size(); ++node)
+        tree.cost += perimeter(tree.nodes[node].lo, tree.nodes[node].hi);
+    tree.builtCost = tree.cost;
+    return tree;
+}
+
+void Bvh::buildNode(Tree& tree, std::vector<Ref>& refs, unsigned node, size_t first, size_t last)
+{
+    glm::vec2 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+    glm::vec2 centerLo = lo, centerHi = hi;
+    for (size_t i = first; i < last; ++i)
+    {
+        const Box& box = refs[i].box;
+        lo = glm::min(lo, box.lo);
+        hi = glm::max(hi, box.hi);
+        glm::vec2 center = (box.lo + box.hi) * 0.5f;
+        centerLo = glm::min(centerLo, center);
+        centerHi = glm::max(centerHi, center);
+    }
+    tree.nodes[node].lo = lo;
+    tree.nodes[node].hi = hi;
+
+    if (last - first <= LEAF_SIZE || centerLo == centerHi)
+    {
+        tree.nodes[node].first = first;
+        tree.nodes[node].count = last - first;
+        for (size_t i = first; i < last; ++i)
+        {
+            tree.items[i] = refs[i].id;
+            tree.leaves[refs[i].id] = node;
+        }
+        return;
+    }
+
+    // Median of the centers along the longest axis, both halves get half of the items
+    int axis = (centerHi.x - centerLo.x >= centerHi.y - centerLo.y) ? 0 : 1;
+    size_t middle = (first + last) / 2;
+    std::nth_element(refs.begin() + first, refs.begin() + middle, refs.begin() + last,
+        [&](const Ref& a, const Ref& b) { return a.box.lo[axis] + a.box.hi[axis] < b.box.lo[axis] + b.box.hi[axis]; });
+
+    unsigned child = tree.nodes.size();
+    tree.nodes.resize(child + 2);
+    tree.parents.resize(child + 2, node);
+    tree.nodes[node].first = child;
+    tree.nodes[node].count = 0;
+    buildNode(tree, refs, child, first, middle);
+    buildNode(tree, refs, child + 1, middle, last);
+}
+
+void Bvh::adopt(Tree&& built)
+{
+    tree = std::move(built);
+    ++stats.rebuilds;
+
+    // The tree has the boxes of the copy, bring the items updated since up to date
+    for (size_t i = 0; i < updatedSince.size(); ++i)
+    {
+        unsigned id = updatedSince[i];
+        if (id < boxes.size() && id < tree.leaves.size() && tree.leaves[id] != NONE)
+            refit(id);
+    }
+    updatedSince.clear();
+
+    pending.clear();
+    isPending.assign(boxes.size(), false);
+    for (size_t id = 0; id < boxes.size(); ++id)
+    {
+        bool inTree = id < tree.leaves.size() && tree.leaves[id] != NONE;
+        if (!inTree && boxes[id].lo.x <= boxes[id].hi.x)
+            addPending(id);
+    }
+}
+
+bool Bvh::degraded() const
+{
+    size_t live = boxes.size();
+    return tree.cost > 2.0 * tree.builtCost
+        || pending.size() > std::max<size_t>(64, live / 8)
+        || tree.count > live + std::max<size_t>(64, live / 4);
+}
+
+void Bvh::rebuild()
+{
+    if (rebuilding.valid())
+        rebuilding.wait();
+    rebuilding = std::future<Tree>();
+    updatedSince.clear();
+    adopt(build(boxes));
+}
+
+void Bvh::poll()
+{
+    if (rebuilding.valid())
+    {
+        if (rebuilding.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            return;
+        adopt(rebuilding.get());
+    }
+
+    if (!degraded())
+        return;
+
+    // Nothing to query meanwhile but the pending list, e.g. the first time, rebuild now
+    if (tree.count < pending.size())
+    {
+        rebuild();
+        return;
+    }
+    updatedSince.clear();
+    rebuilding = std::async(std::launch::async, &Bvh::build, boxes);
+}
+
+void Bvh::query(glm::vec2 lo, glm::vec2 hi, std::vector<unsigned>& out) const
+{
+    out.clear();
+    ++stats.queries;
+
+    if (!tree.nodes.empty())
+    {
+        unsigned stack[64];
+        size_t top = 0;
+        stack[top++] = 0;
+        while (top)
+        {
+            const Node& node = tree.nodes[stack[--top]];
+            ++stats.nodesVisited;
+            if (!overlaps(node.lo, node.hi, lo, hi))
+                continue;
+            if (node.count)
+            {
+                for (unsigned i = node.first; i < node.first + node.count; ++i)
+                {
+                    unsigned id = tree.items[i];
+                    ++stats.itemsTested;
+                    if (id < boxes.size() && overlaps(boxes[id].lo, boxes[id].hi, lo, hi))
+                        out.push_back(id);
+                }
+            }
+            else
+            {
+                stack[top++] = node.first;
+                stack[top++] = node.first + 1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+        unsigned id = pending[i];
+        ++stats.itemsTested;
+        if (overlaps(boxes[id].lo, boxes[id].hi, lo, hi))
+            out.push_back(id);
+    }
+
+    std::sort(out.begin(), out.end());
+}
+
+bool Bvh::nearest(glm::vec2 p, float limit, const std::function<float(unsigned)>& distanceTo, unsigned& id, float& best) const
+{
+    ++stats.queries;
+    id = NONE;
+    best = limit;
+
+    // The pending items first, their distance prunes the tree
+    for (size_t i = 0; i < pending.size(); ++i)
+    {
+        unsigned item = pending[i];
+        ++stats.itemsTested;
+        if (distance(p, boxes[item].lo, boxes[item].hi) >= best)
+            continue;
+        float d = distanceTo(item);
+        if (d < best)
+        {
+            best = d;
+            id = item;
+        }
+    }
+
+    if (!tree.nodes.empty())
+    {
+        // Depth first, the closer child first, skipping the nodes farther than the best item
+        std::pair<float, unsigned> stack[64];
+        size_t top = 0;
+        stack[top++] = std::make_pair(distance(p, tree.nodes[0].lo, tree.nodes[0].hi), 0u);
+        while (top)
+        {
+            std::pair<float, unsigned> entry = stack[--top];
+            if (entry.first >= best)
+                continue;
+            const Node& node = tree.nodes[entry.second];
+            ++stats.nodesVisited;
+            if (node.count)
+            {
+                for (unsigned i = node.first; i < node.first + node.count; ++i)
+                {
+                    unsigned item = tree.items[i];
+                    ++stats.itemsTested;
+                    if (item >= boxes.size() || distance(p, boxes[item].lo, boxes[item].hi) >= best)
+                        continue;
+                    float d = distanceTo(item);
+                    if (d < best)
+                    {
+                        best = d;
+                        id = item;
+                    }
+                }
+            }
+            else
+            {
+                float left = distance(p, tree.nodes[node.first].lo, tree.nodes[node.first].hi);
+                float right = distance(p, tree.nodes[node.first + 1].lo, tree.nodes[node.first + 1].hi);
+                if (left < right)
+                {
+                    stack[top++] = std::make_pair(right, node.first + 1);
+                    stack[top++] = std::make_pair(left, node.first);
+                }
+                else
+                {
+                    stack[top++] = std::make_pair(left, node.first);
+                    stack[top++] = std::make_pair(right, node.first + 1);
+                }
+            }
+        }
+    }
+
+    return id != NONE;
+}
@@ -0,0 +1,127 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <future>
+#include <functional>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+///
+/// Bounding volume hierarchy over items 0..size()-1 and their bounding box,
+/// split at the median of the longest axis so that uneven densities stay balanced.
+/// Moving an item refits the boxes of its ancestors in place, new items wait in
+/// a list scanned by every query. Once the refits or the new items cost too much,
+/// poll() rebuilds the tree on a background thread and swaps it in when done.
+///
+class Bvh
+{
+public:
+    // Items per leaf at most, unless they all have the same center
+    static const size_t LEAF_SIZE = 4;
+
+    // Counters of the queries and maintenance since the last reset
+    struct Stats
+    {
+        size_t queries;
+        size_t nodesVisited;
+        size_t itemsTested;
+        size_t refits;
+        size_t rebuilds;
+
+        Stats() : queries(0), nodesVisited(0), itemsTested(0), refits(0), rebuilds(0) {}
+    };
+
+    Bvh();
+    ~Bvh();
+
+    // Set the bounding box of item id, adding the items up to id as needed
+    void update(unsigned id, glm::vec2 lo, glm::vec2 hi);
+
+    // Remove the items id >= count
+    void resize(size_t count);
+
+    size_t size() const { return boxes.size(); }
+
+    // Bounding box of item id
+    glm::vec2 lower(unsigned id) const { return boxes[id].lo; }
+    glm::vec2 upper(unsigned id) const { return boxes[id].hi; }
+
+    // Swap in a finished background rebuild, and start one if the tree degraded
+    void poll();
+
+    // Rebuild the tree now, on this thread
+    void rebuild();
+
+    // Replace out with the ids of the items whose box overlaps [lo, hi], in increasing order
+    void query(glm::vec2 lo, glm::vec2 hi, std::vector<unsigned>& out) const;
+
+    // Item closest to p by distance(id), which is at least the distance from p to the box of id,
+    // false if no item is closer than limit
+    bool nearest(glm::vec2 p, float limit, const std::function<float(unsigned)>& distance, unsigned& id, float& best) const;
+
+    // Nodes in the tree and items waiting for the next rebuild
+    size_t nodes() const { return tree.nodes.size(); }
+    size_t pendingItems() const { return pending.size(); }
+
+    mutable Stats stats;
+
+private:
+    static const unsigned NONE = ~0u;
+
+    struct Box
+    {
+        glm::vec2 lo, hi;
+    };
+
+    // Leaves list the items [first, first + count) of Tree::items, the children
+    // of an internal node (count 0) are the nodes first and first + 1
+    struct Node
+    {
+        glm::vec2 lo, hi;
+        unsigned first;
+        unsigned count;
+    };
+
+    struct Tree
+    {
+        std::vector<Node> nodes;
+        std::vector<unsigned> parents;
+        std::vector<unsigned> items;
+        // Leaf of each item, NONE if it is not in the tree
+        std::vector<unsigned> leaves;
+        // Sum of the perimeters of the nodes, grows as refits loosen them
+        double cost;
+        double builtCost;
+        // Items in the tree
+        size_t count;
+
+        Tree() : cost(0.0), builtCost(0.0), count(0) {}
+    };
+
+    std::vector<Box> boxes;
+    Tree tree;
+    // Items with a box but not in the tree, and a flag per item
+    std::vector<unsigned> pending;
+    std::vector<bool> isPending;
+
+    // Background rebuild from a copy of the boxes, and the items updated since the copy
+    std::future<Tree> rebuilding;
+    std::vector<unsigned> updatedSince;
+
+    static Tree build(std::vector<Box> boxes);
+    // Box of an item copied next to its id, so that the build reads them in sequence
+    struct Ref
+    {
+        Box box;
+        unsigned id;
+    };
+
+    static void buildNode(Tree& tree, std::vector<Ref>& refs, unsigned node, size_t first, size_t last);
+    void adopt(Tree&& built);
+    void refit(unsigned id);
+    void addPending(unsigned id);
+    bool degraded() const;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "EdgeTable.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+
+const size_t EdgeTable::LANES;
+
+EdgeTable::Edges EdgeTable::edges(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2)
+{
+    // Twice the signed area, in double so that a thin triangle does not round to none
+    double area = (double(p1.x) - p0.x) * (double(p2.y) - p0.y) - (double(p1.y) - p0.y) * (double(p2.x) - p0.x);
+
+    // No point is at a distance >= 0 of all three edges 0 x + 0 y - 1
+    Edges out;
+    if (!(std::abs(area) > 0.0) || !std::isfinite(area))
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            out.a[k] = out.b[k] = 0.0f;
+            out.c[k] = -1.0f;
+        }
+        return out;
+    }
+
+    // Counter-clockwise order, so that the inside is where the three edges are positive
+    glm::vec2 p[3] = { p0, p1, p2 };
+    if (area < 0.0)
+        std::swap(p[1], p[2]);
+    for (int k = 0; k < 3; ++k)
+    {
+        glm::vec2 v1 = p[(k + 1) % 3];
+        glm::vec2 v2 = p[(k + 2) % 3];
+        double dx = double(v2.x) - v1.x, dy = double(v2.y) - v1.y;
+        double length = std::sqrt(dx * dx + dy * dy);
+        out.a[k] = float(-dy / length);
+        out.b[k] = float(dx / length);
+        out.c[k] = float(-(double(out.a[k]) * v1.x + double(out.b[k]) * v1.y));
+    }
+    return out;
+}
+
+bool EdgeTable::contains(const Edges& edges, glm::vec2 p)
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        if (!(edges.a[k] * p.x + edges.b[k] * p.y + edges.c[k] >= 0.0f))
+            return false;
+    }
+    return true;
+}
+
+EdgeTable::Block EdgeTable::emptyBlock()
+{
+    Block block;
+    Edges none = edges(glm::vec2(0.0f), glm::vec2(0.0f), glm::vec2(0.0f));
+    for (size_t lane = 0; lane < LANES; ++lane)
+        set(block, lane, none);
+    return block;
+}
+
+void EdgeTable::set(Block& block, size_t lane, const Edges& edges)
+{
+    for (int k = 0; k < 3; ++k)
+    {
+        block.a[k][lane] = edges.a[k];
+        block.b[k][lane] = edges.b[k];
+        block.c[k][lane] = edges.c[k];
+    }
+}
+
+void EdgeTable::update(unsigned id, glm::vec2 p0, glm::vec2 p1, glm::vec2 p2)
+{
+    if (count <= id)
+        resize(id + 1);
+    set(blocks[id / LANES], id % LANES, edges(p0, p1, p2));
+}
+
+void EdgeTable::clear(unsigned id)
+{
+    update(id, glm::vec2(0.0f), glm::vec2(0.0f), glm::vec2(0.0f));
+}
+
+void EdgeTable::resize(size_t n)
+{
+    // The lanes past the last triangle contain no point, so that a whole block is always tested
+    blocks.resize((n + LANES - 1) / LANES, emptyBlock());
+    Edges none = edges(glm::vec2(0.0f), glm::vec2(0.0f), glm::vec2(0.0f));
+    for (size_t id = n; id < std::min(count, blocks.size() * LANES); ++id)
+        set(blocks[id / LANES], id % LANES, none);
+    count = n;
+}
+
+bool EdgeTable::contains(unsigned id, glm::vec2 p) const
+{
+    const Block& block = blocks[id / LANES];
+    size_t lane = id % LANES;
+    for (int k = 0; k < 3; ++k)
+    {
+        if (!(block.a[k][lane] * p.x + block.b[k][lane] * p.y + block.c[k][lane] >= 0.0f))
+            return false;
+    }
+    return true;
+}
+
+int EdgeTable::insideMask(const Block& block, glm::vec2 p)
+{
+    // Same expression as contains(), evaluated for the 4 lanes at once
+    // A point within rounding of an edge may land on the other side than with contains(),
+    // e.g. when the compiler contracts one of them into fused multiply-adds
+    Float4 x(p.x), y(p.y), zero(0.0f);
+    Float4 inside = (zero == zero);
+    for (int k = 0; k < 3; ++k)
+    {
+        Float4 e = Float4::load(block.a[k]) * x + Float4::load(block.b[k]) * y + Float4::load(block.c[k]);
+        inside = inside & (e >= zero);
+    }
+    return inside.mask();
+}
+
+void EdgeTable::containing(glm::vec2 p, size_t first, size_t last, std::vector<unsigned>& out) const
+{
+    last = std::min(last, count);
+    for (size_t b = first / LANES; b * LANES < last; ++b)
+    {
+        int mask = insideMask(blocks[b], p);
+        for (size_t lane = 0; lane < LANES; ++lane)
+        {
+            size_t id = b * LANES + lane;
+            if (id < first || id >= last)
+                continue;
+            if ((mask >> lane) & 1)
+                out.push_back(id);
+        }
+    }
+}
+
+void EdgeTable::filter(glm::vec2 p, std::vector<unsigned>& ids) const
+{
+    // The edges of 4 ids at a time gathered into one block, the missing lanes contain no point
+    static const Block EMPTY = emptyBlock();
+    size_t n = 0;
+    for (size_t i = 0; i < ids.size(); i += LANES)
+    {
+        Block gathered = EMPTY;
+        size_t lanes = std::min(ids.size() - i, LANES);
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            const Block& block = blocks[ids[i + lane] / LANES];
+            size_t from = ids[i + lane] % LANES;
+            for (int k = 0; k < 3; ++k)
+            {
+                gathered.a[k][lane] = block.a[k][from];
+                gathered.b[k][lane] = block.b[k][from];
+                gathered.c[k][lane] = block.c[k][from];
+            }
+        }
+
+        int mask = insideMask(gathered, p);
+        for (size_t lane = 0; lane < lanes; ++lane)
+        {
+            unsigned id = ids[i + lane];
+            if ((mask >> lane) & 1)
+                ids[n++] = id;
+        }
+    }
+    ids.resize(n);
+}
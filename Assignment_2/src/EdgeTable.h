@@ -0,0 +1,75 @@
+#ifndef EDGE_TABLE_H
+#define EDGE_TABLE_H
+
+#include <vector>
+#include <cstddef>
+#include <glm/glm.hpp>
+
+///
+/// Edge equations of the triangles 0..size()-1, precomputed once per edit so
+/// that testing a point is 3 multiply-adds per edge and no division. Edge k is
+/// a[k] x + b[k] y + c[k], the signed distance to it, positive inside in either
+/// winding. The equations are stored by blocks of 4 triangles, each coefficient
+/// of the 4 side by side, so that a point is tested against 4 triangles at once.
+/// The boundary is inside, degenerate and incomplete triangles contain no point.
+///
+class EdgeTable
+{
+public:
+    // Triangles tested together
+    static const size_t LANES = 4;
+
+    // Edge equations of one triangle
+    struct Edges
+    {
+        float a[3];
+        float b[3];
+        float c[3];
+    };
+
+    // Normalized edges of the triangle (p0, p1, p2), the ones of a triangle
+    // without area reject every point
+    static Edges edges(glm::vec2 p0, glm::vec2 p1, glm::vec2 p2);
+
+    // True if p is inside the triangle of the edges or on its boundary
+    static bool contains(const Edges& edges, glm::vec2 p);
+
+    EdgeTable() : count(0) {}
+
+    // Set the triangle id, adding the triangles up to id as needed
+    void update(unsigned id, glm::vec2 p0, glm::vec2 p1, glm::vec2 p2);
+
+    // Make the triangle id contain no point, e.g. while it is incomplete
+    void clear(unsigned id);
+
+    // Keep the triangles id < count
+    void resize(size_t count);
+
+    size_t size() const { return count; }
+
+    // Same as contains(edges, p) for the triangle id, one triangle at a time
+    bool contains(unsigned id, glm::vec2 p) const;
+
+    // Append the triangles of [first, last) containing p to out, in increasing order
+    void containing(glm::vec2 p, size_t first, size_t last, std::vector<unsigned>& out) const;
+
+    // Keep the ids of the triangles containing p, in the same order
+    void filter(glm::vec2 p, std::vector<unsigned>& ids) const;
+
+private:
+    struct Block
+    {
+        float a[3][LANES];
+        float b[3][LANES];
+        float c[3][LANES];
+    };
+
+    std::vector<Block> blocks;
+    size_t count;
+
+    static Block emptyBlock();
+    static void set(Block& block, size_t lane, const Edges& edges);
+    static int insideMask(const Block& block, glm::vec2 p);
+};
+
+#endif
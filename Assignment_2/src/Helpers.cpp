@@ -2,6 +2,141 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <sstream>
+#include <iterator>
+#include <iomanip>
+
+#ifdef _WIN32
+#  include <direct.h> // _mkdir
+#else
+#  include <sys/stat.h> // mkdir
+#endif
+
+GLState& GLState::current()
+{
+  static GLState state;
+  return state;
+}
+
+void GLState::useProgram(GLuint id)
+{
+  if (changed(program != id))
+  {
+    glUseProgram(id);
+    program = id;
+    check_gl_error();
+  }
+}
+
+void GLState::bindVertexArray(GLuint id)
+{
+  if (changed(vertex_array != id))
+  {
+    glBindVertexArray(id);
+    vertex_array = id;
+    check_gl_error();
+  }
+}
+
+GLuint* GLState::binding(GLenum target)
+{
+  switch (target)
+  {
+    case GL_ARRAY_BUFFER:      return &array_buffer;
+    case GL_COPY_READ_BUFFER:  return &copy_read_buffer;
+    case GL_COPY_WRITE_BUFFER: return &copy_write_buffer;
+  }
+  return NULL;
+}
+
+void GLState::bindBuffer(GLenum target, GLuint id)
+{
+  GLuint* bound = binding(target);
+  if (changed(bound == NULL || *bound != id))
+  {
+    glBindBuffer(target, id);
+    if (bound)
+      *bound = id;
+  }
+}
+
+void GLState::lineWidth(GLfloat width)
+{
+  if (changed(line_width != width))
+  {
+    glLineWidth(width);
+    line_width = width;
+  }
+}
+
+void GLState::enable(GLenum cap, bool enabled)
+{
+  GLint* flag = (cap == GL_BLEND) ? &blend : (cap == GL_DEPTH_TEST) ? &depth_test : NULL;
+  if (changed(flag == NULL || *flag != (enabled ? 1 : 0)))
+  {
+    if (enabled)
+      glEnable(cap);
+    else
+      glDisable(cap);
+    if (flag)
+      *flag = enabled ? 1 : 0;
+  }
+}
+
+void GLState::blendFunc(GLenum src, GLenum dst)
+{
+  if (changed(blend_src != src || blend_dst != dst || blend_src_alpha != src || blend_dst_alpha != dst))
+  {
+    glBlendFunc(src, dst);
+    blend_src = blend_src_alpha = src;
+    blend_dst = blend_dst_alpha = dst;
+  }
+}
+
+void GLState::blendFuncSeparate(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha)
+{
+  if (changed(blend_src != src_rgb || blend_dst != dst_rgb || blend_src_alpha != src_alpha || blend_dst_alpha != dst_alpha))
+  {
+    glBlendFuncSeparate(src_rgb, dst_rgb, src_alpha, dst_alpha);
+    blend_src = src_rgb;
+    blend_dst = dst_rgb;
+    blend_src_alpha = src_alpha;
+    blend_dst_alpha = dst_alpha;
+  }
+}
+
+void GLState::deleteProgram(GLuint id)
+{
+  if (program == id)
+    program = 0;
+}
+
+void GLState::deleteVertexArray(GLuint id)
+{
+  if (vertex_array == id)
+    vertex_array = 0;
+}
+
+void GLState::deleteBuffer(GLuint id)
+{
+  if (array_buffer == id)
+    array_buffer = 0;
+  if (copy_read_buffer == id)
+    copy_read_buffer = 0;
+  if (copy_write_buffer == id)
+    copy_write_buffer = 0;
+}
+
+void GLState::invalidate()
+{
+  // Values no real state can have, so that the next request always differs
+  program = vertex_array = ~0u;
+  array_buffer = copy_read_buffer = copy_write_buffer = ~0u;
+  line_width = -1.0f;
+  blend = depth_test = -1;
+  blend_src = blend_dst = blend_src_alpha = blend_dst_alpha = GL_NONE;
+}
 
 void VertexArrayObject::init()
 {
@@ -11,13 +146,13 @@ void VertexArrayObject::init()
 
 void VertexArrayObject::bind()
 {
-  glBindVertexArray(id);
-  check_gl_error();
+  GLState::current().bindVertexArray(id);
 }
 
 void VertexArrayObject::free()
 {
   glDeleteVertexArrays(1, &id);
+  GLState::current().deleteVertexArray(id);
   check_gl_error();
 }
 
@@ -29,24 +164,541 @@ void VertexBufferObject::init()
 
 void VertexBufferObject::bind()
 {
-  glBindBuffer(GL_ARRAY_BUFFER,id);
+  GLState::current().bindBuffer(GL_ARRAY_BUFFER, id);
+}
+
+void VertexBufferObject::reserve(size_t size)
+{
+  GLState::current().bindBuffer(GL_ARRAY_BUFFER, id);
+  if (size <= capacity)
+    return;
+
+  capacity = std::max(size, capacity * 2);
+  glBufferData(GL_ARRAY_BUFFER, capacity, NULL, GL_DYNAMIC_DRAW);
+  check_gl_error();
+}
+
+void VertexBufferObject::shrink()
+{
+  // Without the element size the content would be released with the rest
+  assert(cols == 0 || element_size != 0);
+  size_t size = cols * element_size;
+  if (size >= capacity)
+    return;
+
+  if (size == 0)
+  {
+    GLState::current().bindBuffer(GL_ARRAY_BUFFER, id);
+    glBufferData(GL_ARRAY_BUFFER, 0, NULL, GL_DYNAMIC_DRAW);
+    capacity = 0;
+    check_gl_error();
+    return;
+  }
+
+  // Round-trip the content through a temporary buffer so that the id,
+  // and every VAO that references it, stays valid
+  GLState& state = GLState::current();
+  GLuint tmp;
+  glGenBuffers(1, &tmp);
+  state.bindBuffer(GL_COPY_WRITE_BUFFER, tmp);
+  glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STREAM_COPY);
+  state.bindBuffer(GL_COPY_READ_BUFFER, id);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+  glBufferData(GL_COPY_READ_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+  glCopyBufferSubData(GL_COPY_WRITE_BUFFER, GL_COPY_READ_BUFFER, 0, 0, size);
+  glDeleteBuffers(1, &tmp);
+  state.deleteBuffer(tmp);
+  capacity = size;
   check_gl_error();
 }
 
 void VertexBufferObject::free()
 {
   glDeleteBuffers(1,&id);
+  GLState::current().deleteBuffer(id);
+  capacity = 0;
+  check_gl_error();
+}
+
+void BufferTexture::init(GLenum internal_format, GLuint buffer)
+{
+  glGenTextures(1, &id);
+  glBindTexture(GL_TEXTURE_BUFFER, id);
+  glTexBuffer(GL_TEXTURE_BUFFER, internal_format, buffer);
+  check_gl_error();
+}
+
+void BufferTexture::bind(GLuint unit)
+{
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_BUFFER, id);
+}
+
+void BufferTexture::free()
+{
+  glDeleteTextures(1, &id);
+  check_gl_error();
+}
+
+bool FramebufferObject::init(int w, int h)
+{
+  width = w;
+  height = h;
+  glGenRenderbuffers(1, &color);
+  glBindRenderbuffer(GL_RENDERBUFFER, color);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glGenRenderbuffers(1, &depth);
+  glBindRenderbuffer(GL_RENDERBUFFER, depth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+  glGenFramebuffers(1, &id);
+  glBindFramebuffer(GL_FRAMEBUFFER, id);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  check_gl_error();
+  return status == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void FramebufferObject::bind()
+{
+  glBindFramebuffer(GL_FRAMEBUFFER, id);
+  glViewport(0, 0, width, height);
+}
+
+void FramebufferObject::readPixels(std::vector<unsigned char>& rgb) const
+{
+  size_t row = width * 3;
+  rgb.resize(row * height);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, id);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rgb.data());
+  check_gl_error();
+
+  // GL returns the bottom row first
+  for (int y = 0; y < height / 2; ++y)
+    std::swap_ranges(rgb.begin() + y * row, rgb.begin() + (y + 1) * row, rgb.begin() + (height - 1 - y) * row);
+}
+
+void FramebufferObject::free()
+{
+  glDeleteFramebuffers(1, &id);
+  glDeleteRenderbuffers(1, &color);
+  glDeleteRenderbuffers(1, &depth);
+  check_gl_error();
+}
+
+// Integer textures only take integer data, even when there is none to upload
+static bool is_integer_format(GLenum internal_format)
+{
+  switch (internal_format)
+  {
+    case GL_R8UI: case GL_R16UI: case GL_R32UI: case GL_RGBA8UI: case GL_RGBA16UI: case GL_RGBA32UI:
+    case GL_R8I: case GL_R16I: case GL_R32I: case GL_RGBA8I: case GL_RGBA16I: case GL_RGBA32I:
+      return true;
+  }
+  return false;
+}
+
+bool TextureFramebuffer::init(int w, int h, const std::vector<GLenum>& internal_formats, bool with_depth)
+{
+  width = w;
+  height = h;
+  glGenFramebuffers(1, &id);
+  glBindFramebuffer(GL_FRAMEBUFFER, id);
+
+  textures.resize(internal_formats.size());
+  glGenTextures(textures.size(), textures.data());
+  std::vector<GLenum> attachments;
+  for (size_t i = 0; i < textures.size(); ++i)
+  {
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+    // Only the format matters, GL picks the type of the unused initial data
+    if (is_integer_format(internal_formats[i]))
+      glTexImage2D(GL_TEXTURE_2D, 0, internal_formats[i], width, height, 0, GL_RGBA_INTEGER, GL_INT, NULL);
+    else
+      glTexImage2D(GL_TEXTURE_2D, 0, internal_formats[i], width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, textures[i], 0);
+    attachments.push_back(GL_COLOR_ATTACHMENT0 + i);
+  }
+  glDrawBuffers(attachments.size(), attachments.data());
+
+  if (with_depth)
+  {
+    glGenRenderbuffers(1, &depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+  }
+
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  check_gl_error();
+  return status == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void TextureFramebuffer::bind()
+{
+  glBindFramebuffer(GL_FRAMEBUFFER, id);
+  glViewport(0, 0, width, height);
+}
+
+void TextureFramebuffer::bindTextures(GLuint first_unit) const
+{
+  for (size_t i = 0; i < textures.size(); ++i)
+  {
+    glActiveTexture(GL_TEXTURE0 + first_unit + i);
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+  }
+  glActiveTexture(GL_TEXTURE0);
+  check_gl_error();
+}
+
+void TextureFramebuffer::free()
+{
+  glDeleteFramebuffers(1, &id);
+  glDeleteTextures(textures.size(), textures.data());
+  glDeleteRenderbuffers(1, &depth);
+  textures.clear();
+  id = depth = 0;
+  check_gl_error();
+}
+
+void PixelReadback::init()
+{
+  glGenBuffers(1, &buffer);
+  GLState::current().bindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+  glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(GLuint), NULL, GL_STREAM_READ);
+  GLState::current().bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  check_gl_error();
+}
+
+void PixelReadback::read(GLuint framebuffer, GLenum attachment, int px, int py)
+{
+  x = px;
+  y = py;
+
+  // With a pack buffer bound, glReadPixels only queues the copy and returns
+  GLState& state = GLState::current();
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+  glReadBuffer(attachment);
+  state.bindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+  glReadPixels(x, y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+  state.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  if (fence)
+    glDeleteSync(fence);
+  fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  check_gl_error();
+}
+
+GLuint PixelReadback::value()
+{
+  if (!fence)
+    return result;
+
+  GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  if (status == GL_TIMEOUT_EXPIRED)
+  {
+    ++stalls;
+    while (status == GL_TIMEOUT_EXPIRED)
+      status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+  }
+  glDeleteSync(fence);
+  fence = 0;
+
+  GLState& state = GLState::current();
+  state.bindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+  const GLuint* mapped = (const GLuint*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(GLuint), GL_MAP_READ_BIT);
+  if (mapped)
+  {
+    result = *mapped;
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  state.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  check_gl_error();
+  return result;
+}
+
+void PixelReadback::free()
+{
+  if (fence)
+    glDeleteSync(fence);
+  fence = 0;
+  glDeleteBuffers(1, &buffer);
+  GLState::current().deleteBuffer(buffer);
+  buffer = 0;
+  discard();
+  check_gl_error();
+}
+
+bool write_ppm(const std::string& path, int width, int height, const std::vector<unsigned char>& rgb)
+{
+  std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+  file << "P6\n" << width << " " << height << "\n255\n";
+  file.write((const char*) rgb.data(), rgb.size());
+  return bool(file);
+}
+
+void StreamingBuffer::init(size_t size, GLuint count)
+{
+  frames = count;
+  current = 0;
+  region_size = (size + 255) & ~size_t(255);
+  fences.assign(frames, (GLsync) 0);
+
+  size_t total = region_size * frames;
+  glGenBuffers(1, &id);
+  GLState::current().bindBuffer(GL_ARRAY_BUFFER, id);
+
+  persistent = false;
+  mapped = NULL;
+#ifndef __APPLE__
+  if (GLEW_ARB_buffer_storage)
+  {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, total, NULL, flags);
+    mapped = (char*) glMapBufferRange(GL_ARRAY_BUFFER, 0, total, flags);
+    persistent = (mapped != NULL);
+  }
+#endif
+  if (!persistent)
+    glBufferData(GL_ARRAY_BUFFER, total, NULL, GL_STREAM_DRAW);
+  check_gl_error();
+}
+
+void StreamingBuffer::reserve(size_t size)
+{
+  if (size <= region_size)
+    return;
+
+  GLuint count = frames;
+  size_t grown = std::max(size, region_size * 2);
+  free();
+  init(grown, count);
+}
+
+void* StreamingBuffer::map()
+{
+  wait(current);
+  size_t offset = current * region_size;
+  if (persistent)
+    return mapped + offset;
+
+  // The fence already guarantees the region is idle, so skip the driver's own synchronization
+  GLState::current().bindBuffer(GL_ARRAY_BUFFER, id);
+  void* ptr = glMapBufferRange(GL_ARRAY_BUFFER, offset, region_size,
+    GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+  check_gl_error();
+  return ptr;
+}
+
+size_t StreamingBuffer::unmap()
+{
+  if (!persistent)
+  {
+    GLState::current().bindBuffer(GL_ARRAY_BUFFER, id);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    check_gl_error();
+  }
+  return current * region_size;
+}
+
+void StreamingBuffer::advance()
+{
+  if (fences[current])
+    glDeleteSync(fences[current]);
+  fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  current = (current + 1) % frames;
+  check_gl_error();
+}
+
+void StreamingBuffer::retain()
+{
+  GLuint previous = (current + frames - 1) % frames;
+  if (fences[previous])
+    glDeleteSync(fences[previous]);
+  fences[previous] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
   check_gl_error();
 }
 
+void StreamingBuffer::wait(GLuint region)
+{
+  GLsync fence = fences[region];
+  if (!fence)
+    return;
+
+  GLenum status = glClientWaitSync(fence, 0, 0);
+  if (status == GL_TIMEOUT_EXPIRED)
+  {
+    ++stalls;
+    while (status == GL_TIMEOUT_EXPIRED)
+      status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+  }
+  glDeleteSync(fence);
+  fences[region] = 0;
+}
+
+void StreamingBuffer::free()
+{
+  for (size_t i = 0; i < fences.size(); ++i)
+    if (fences[i])
+      glDeleteSync(fences[i]);
+  fences.clear();
+
+  if (persistent)
+  {
+    GLState::current().bindBuffer(GL_ARRAY_BUFFER, id);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  glDeleteBuffers(1, &id);
+  GLState::current().deleteBuffer(id);
+  id = 0;
+  mapped = NULL;
+  region_size = 0;
+  check_gl_error();
+}
+
+std::string Program::binary_cache_dir;
+Program::GLuint Program::binary_cache_hits = 0;
+Program::GLuint Program::binary_cache_misses = 0;
+
+// True if the driver can save and reload linked programs
+static bool program_binary_supported()
+{
+#ifndef __APPLE__
+  if (!GLEW_ARB_get_program_binary)
+    return false;
+#endif
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  return formats > 0;
+}
+
+// FNV-1a, folding in a separator after each string
+static void hash_string(unsigned long long &hash, const std::string &string)
+{
+  for (size_t i = 0; i <= string.size(); ++i)
+  {
+    hash ^= (unsigned char) (i < string.size() ? string[i] : 0);
+    hash *= 1099511628211ULL;
+  }
+}
+
+// Cache file of a program, a binary is only valid for the driver that produced it
+static std::string program_binary_path(const std::vector<std::string> &inputs)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < inputs.size(); ++i)
+    hash_string(hash, inputs[i]);
+  hash_string(hash, (const char*) glGetString(GL_RENDERER));
+  hash_string(hash, (const char*) glGetString(GL_VERSION));
+
+  std::ostringstream path;
+  path << Program::binary_cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+  return path.str();
+}
+
+bool Program::load_binary(const std::string &path)
+{
+  // A truncated or empty file is recompiled, not handed to the driver
+  std::ifstream file(path.c_str(), std::ios::binary);
+  GLenum format;
+  GLint length;
+  if (!file.read((char*) &format, sizeof(format)) || !file.read((char*) &length, sizeof(length)) || length <= 0)
+    return false;
+  std::vector<char> binary(length);
+  if (!file.read(binary.data(), length) || file.peek() != std::ifstream::traits_type::eof())
+    return false;
+
+  program_shader = glCreateProgram();
+  glProgramBinary(program_shader, format, binary.data(), length);
+
+  GLint status;
+  glGetProgramiv(program_shader, GL_LINK_STATUS, &status);
+  if (status != GL_TRUE)
+  {
+    // A binary of another driver is rejected with GL_INVALID_ENUM, which check_gl_error would report later
+    while (glGetError() != GL_NO_ERROR) {}
+    glDeleteProgram(program_shader);
+    program_shader = 0;
+    return false;
+  }
+  return true;
+}
+
+void Program::save_binary(const std::string &path) const
+{
+  GLint length = 0;
+  glGetProgramiv(program_shader, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  std::vector<char> binary(length);
+  GLenum format;
+  glGetProgramBinary(program_shader, length, NULL, &format, binary.data());
+
+#ifdef _WIN32
+  _mkdir(binary_cache_dir.c_str());
+#else
+  mkdir(binary_cache_dir.c_str(), 0755);
+#endif
+  std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+  file.write((const char*) &format, sizeof(format));
+  file.write((const char*) &length, sizeof(length));
+  file.write(binary.data(), binary.size());
+  if (!file)
+    std::cerr << "Could not write the program binary " << path << std::endl;
+}
+
+// Insert the defines after the #version line, which has to stay first
+static std::string specialize_shader(const std::string &shader_string, const std::string &defines)
+{
+  if (defines.empty() || shader_string.empty())
+    return shader_string;
+  size_t line_end = shader_string.find('\n');
+  if (line_end == std::string::npos)
+    return defines + shader_string;
+  return shader_string.substr(0, line_end + 1) + defines + shader_string.substr(line_end + 1);
+}
+
 bool Program::init(
   const std::string &vertex_shader_string,
   const std::string &fragment_shader_string,
-  const std::string &fragment_data_name)
+  const std::string &fragment_data_name,
+  const std::string &defines,
+  const VertexAttrib* layout, size_t layout_size)
 {
   using namespace std;
-  vertex_shader = create_shader_helper(GL_VERTEX_SHADER, vertex_shader_string);
-  fragment_shader = create_shader_helper(GL_FRAGMENT_SHADER, fragment_shader_string);
+
+  // Everything that ends up in the linked program is part of the cache key
+  string binary_path;
+  if (!binary_cache_dir.empty() && program_binary_supported())
+  {
+    vector<string> inputs;
+    inputs.push_back(vertex_shader_string);
+    inputs.push_back(fragment_shader_string);
+    inputs.push_back(fragment_data_name);
+    inputs.push_back(defines);
+    for (size_t i = 0; i < layout_size; ++i)
+      inputs.push_back(layout[i].name);
+    binary_path = program_binary_path(inputs);
+
+    if (load_binary(binary_path))
+    {
+      ++binary_cache_hits;
+      introspect();
+      check_gl_error();
+      return true;
+    }
+    ++binary_cache_misses;
+  }
+
+  vertex_shader = create_shader_helper(GL_VERTEX_SHADER, specialize_shader(vertex_shader_string, defines));
+  fragment_shader = create_shader_helper(GL_FRAGMENT_SHADER, specialize_shader(fragment_shader_string, defines));
 
   if (!vertex_shader || !fragment_shader)
     return false;
@@ -56,7 +708,15 @@ bool Program::init(
   glAttachShader(program_shader, vertex_shader);
   glAttachShader(program_shader, fragment_shader);
 
-  glBindFragDataLocation(program_shader, 0, fragment_data_name.c_str());
+  for (size_t i = 0; i < layout_size; ++i)
+    glBindAttribLocation(program_shader, i, layout[i].name);
+
+  istringstream outputs(fragment_data_name);
+  string output;
+  for (GLuint i = 0; outputs >> output; ++i)
+    glBindFragDataLocation(program_shader, i, output.c_str());
+  if (!binary_path.empty())
+    glProgramParameteri(program_shader, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glLinkProgram(program_shader);
 
   GLint status;
@@ -71,24 +731,62 @@ bool Program::init(
     return false;
   }
 
+  if (!binary_path.empty())
+    save_binary(binary_path);
+
+  introspect();
   check_gl_error();
   return true;
 }
 
+void Program::introspect()
+{
+  uniforms.clear();
+  attributes.clear();
+
+  GLint count = 0, max_length = 0;
+  GLint size;
+  GLenum type;
+
+  glGetProgramiv(program_shader, GL_ACTIVE_UNIFORMS, &count);
+  glGetProgramiv(program_shader, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+  std::vector<char> name(max_length + 1);
+  for (GLint i = 0; i < count; ++i)
+  {
+    glGetActiveUniform(program_shader, i, name.size(), NULL, &size, &type, name.data());
+    std::string key(name.data());
+    GLint location = glGetUniformLocation(program_shader, key.c_str());
+    // Arrays are reported as "name[0]", make them reachable as "name" too
+    if (key.size() > 3 && key.compare(key.size() - 3, 3, "[0]") == 0)
+      uniforms[key.substr(0, key.size() - 3)] = location;
+    uniforms[key] = location;
+  }
+
+  glGetProgramiv(program_shader, GL_ACTIVE_ATTRIBUTES, &count);
+  glGetProgramiv(program_shader, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &max_length);
+  name.resize(max_length + 1);
+  for (GLint i = 0; i < count; ++i)
+  {
+    glGetActiveAttrib(program_shader, i, name.size(), NULL, &size, &type, name.data());
+    attributes[name.data()] = glGetAttribLocation(program_shader, name.data());
+  }
+}
+
 void Program::bind()
 {
-  glUseProgram(program_shader);
-  check_gl_error();
+  GLState::current().useProgram(program_shader);
 }
 
 GLint Program::attrib(const std::string &name) const
 {
-  return glGetAttribLocation(program_shader, name.c_str());
+  std::unordered_map<std::string, GLint>::const_iterator it = attributes.find(name);
+  return it == attributes.end() ? -1 : it->second;
 }
 
 GLint Program::uniform(const std::string &name) const
 {
-  return glGetUniformLocation(program_shader, name.c_str());
+  std::unordered_map<std::string, GLint>::const_iterator it = uniforms.find(name);
+  return it == uniforms.end() ? -1 : it->second;
 }
 
 GLint Program::bindVertexAttribArray(
@@ -110,13 +808,32 @@ GLint Program::bindVertexAttribArray(
   return id;
 }
 
+GLint Program::bindVertexAttrib(const VertexAttrib& vertex_attrib, GLint stride, size_t offset, GLuint divisor) const
+{
+  GLint id = attrib(vertex_attrib.name);
+  if (id < 0)
+    return id;
+  glEnableVertexAttribArray(id);
+  const GLvoid* pointer = (const GLvoid*) (offset + vertex_attrib.offset);
+  if (vertex_attrib.mode == ATTRIB_INTEGER)
+    glVertexAttribIPointer(id, vertex_attrib.size, vertex_attrib.type, stride, pointer);
+  else
+    glVertexAttribPointer(id, vertex_attrib.size, vertex_attrib.type, vertex_attrib.mode == ATTRIB_NORMALIZED ? GL_TRUE : GL_FALSE, stride, pointer);
+  glVertexAttribDivisor(id, divisor);
+
+  return id;
+}
+
 void Program::free()
 {
   if (program_shader)
   {
     glDeleteProgram(program_shader);
+    GLState::current().deleteProgram(program_shader);
     program_shader = 0;
   }
+  uniforms.clear();
+  attributes.clear();
   if (vertex_shader)
   {
     glDeleteShader(vertex_shader);
@@ -163,8 +880,54 @@ GLuint Program::create_shader_helper(GLint type, const std::string &shader_strin
   return id;
 }
 
+// Messages received from the debug output callback since the last check
+static bool gl_debug_output = false;
+static std::vector<std::string> gl_debug_messages;
+
+#if !defined(__APPLE__) && (!defined(NDEBUG) || defined(GL_DIAGNOSTICS))
+static void GLAPIENTRY gl_debug_callback(GLenum /*source*/, GLenum type, GLuint /*id*/, GLenum severity,
+  GLsizei /*length*/, const GLchar *message, const void * /*user*/)
+{
+  if (type == GL_DEBUG_TYPE_ERROR)
+    gl_debug_messages.push_back(std::string("ERROR: ") + message);
+  else if (severity == GL_DEBUG_SEVERITY_HIGH || severity == GL_DEBUG_SEVERITY_MEDIUM)
+    gl_debug_messages.push_back(message);
+}
+#endif
+
+bool enable_gl_debug_output()
+{
+#if !defined(__APPLE__) && (!defined(NDEBUG) || defined(GL_DIAGNOSTICS))
+  // Synchronous output keeps the callback on this thread, right inside the faulty call
+  if (GLEW_KHR_debug)
+  {
+    glEnable(GL_DEBUG_OUTPUT);
+    glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    glDebugMessageCallback(gl_debug_callback, NULL);
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
+    gl_debug_output = true;
+  }
+  else if (GLEW_ARB_debug_output)
+  {
+    glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
+    glDebugMessageCallbackARB(gl_debug_callback, NULL);
+    gl_debug_output = true;
+  }
+#endif
+  return gl_debug_output;
+}
+
 void _check_gl_error(const char *file, int line)
 {
+  // The driver already reported the errors, print them with the location of the check
+  if (gl_debug_output)
+  {
+    for (size_t i = 0; i < gl_debug_messages.size(); ++i)
+      std::cerr << "GL_DEBUG " << gl_debug_messages[i] << " - " << file << ":" << line << std::endl;
+    gl_debug_messages.clear();
+    return;
+  }
+
   GLenum err (glGetError());
 
   while(err!=GL_NO_ERROR)
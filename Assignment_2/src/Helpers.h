@@ -3,9 +3,12 @@
 
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <cstddef> // offsetof
 #include <glm/glm.hpp>  // glm::vec2
 #include <glm/vec3.hpp> // glm::vec3
 #include <glm/vec4.hpp> // glm::vec4
+#include <glm/gtc/type_precision.hpp> // glm::u8vec4, glm::u16vec2
 
 
 #ifdef _WIN32
@@ -33,15 +36,81 @@
 // From: https://blog.nobel-joergensen.com/2013/01/29/debugging-opengl-using-glgeterror/
 void _check_gl_error(const char *file, int line);
 
+// Report the errors through the KHR_debug / GL_ARB_debug_output callback instead of polling glGetError
+// Returns false if the context has no debug output (or checks are compiled out), glGetError is then kept
+bool enable_gl_debug_output();
+
 ///
 /// Usage
 /// [... some opengl calls]
 /// glCheckError();
 ///
+/// Compiled out in release builds (NDEBUG) unless GL_DIAGNOSTICS is defined
+///
+#if defined(NDEBUG) && !defined(GL_DIAGNOSTICS)
+#define check_gl_error() ((void) 0)
+#else
 #define check_gl_error() _check_gl_error(__FILE__,__LINE__)
+#endif
 
 #endif
 
+// Shadow copy of the GL state changed through the helpers
+// Requests that would not change anything are skipped, and both issued and
+// elided calls are counted. Code calling GL directly must invalidate() it.
+class GLState
+{
+public:
+    typedef unsigned int GLuint;
+
+    GLuint program;
+    GLuint vertex_array;
+    GLuint array_buffer;
+    GLuint copy_read_buffer;
+    GLuint copy_write_buffer;
+    GLfloat line_width;
+    // 1 enabled, 0 disabled, -1 unknown
+    GLint blend;
+    GLint depth_test;
+    GLenum blend_src;
+    GLenum blend_dst;
+    GLenum blend_src_alpha;
+    GLenum blend_dst_alpha;
+
+    // Calls forwarded to GL and calls skipped since the last resetCounters()
+    GLuint issued;
+    GLuint elided;
+
+    GLState() : issued(0), elided(0) { invalidate(); }
+
+    // The state of the current context
+    static GLState& current();
+
+    void useProgram(GLuint id);
+    void bindVertexArray(GLuint id);
+    void bindBuffer(GLenum target, GLuint id);
+    void lineWidth(GLfloat width);
+    void enable(GLenum cap, bool enabled);
+    void blendFunc(GLenum src, GLenum dst);
+    void blendFuncSeparate(GLenum src_rgb, GLenum dst_rgb, GLenum src_alpha, GLenum dst_alpha);
+
+    // Forget the bindings of deleted objects, GL resets them to 0
+    void deleteProgram(GLuint id);
+    void deleteVertexArray(GLuint id);
+    void deleteBuffer(GLuint id);
+
+    // Forget everything, the next request of each kind reaches GL
+    void invalidate();
+
+    void resetCounters() { issued = elided = 0; }
+
+private:
+    // Count one request, returns true if it has to be forwarded to GL
+    bool changed(bool differs) { if (differs) ++issued; else ++elided; return differs; }
+
+    GLuint* binding(GLenum target);
+};
+
 class VertexArrayObject
 {
 public:
@@ -59,6 +128,63 @@ public:
     void free();
 };
 
+// GL type of the components of a vertex attribute
+template<typename T> struct GLComponentType;
+template<> struct GLComponentType<GLfloat>  { static const GLenum value = GL_FLOAT; };
+template<> struct GLComponentType<GLbyte>   { static const GLenum value = GL_BYTE; };
+template<> struct GLComponentType<GLubyte>  { static const GLenum value = GL_UNSIGNED_BYTE; };
+template<> struct GLComponentType<GLshort>  { static const GLenum value = GL_SHORT; };
+template<> struct GLComponentType<GLushort> { static const GLenum value = GL_UNSIGNED_SHORT; };
+template<> struct GLComponentType<GLint>    { static const GLenum value = GL_INT; };
+template<> struct GLComponentType<GLuint>   { static const GLenum value = GL_UNSIGNED_INT; };
+
+// Component type and count of a vertex attribute, count is 0 for unsupported types
+template<typename T> struct AttribFormat { typedef void component; static const int count = 0; };
+template<> struct AttribFormat<GLfloat>   { typedef GLfloat component; static const int count = 1; };
+template<> struct AttribFormat<GLuint>    { typedef GLuint component; static const int count = 1; };
+template<> struct AttribFormat<glm::vec2> { typedef GLfloat component; static const int count = 2; };
+template<> struct AttribFormat<glm::vec3> { typedef GLfloat component; static const int count = 3; };
+template<> struct AttribFormat<glm::vec4> { typedef GLfloat component; static const int count = 4; };
+template<> struct AttribFormat<glm::u16vec2> { typedef GLushort component; static const int count = 2; };
+template<> struct AttribFormat<glm::u8vec4>  { typedef GLubyte component; static const int count = 4; };
+
+// How the shader sees an attribute: converted to float, normalized to [0, 1] / [-1, 1], or as integers
+enum AttribMode { ATTRIB_FLOAT, ATTRIB_NORMALIZED, ATTRIB_INTEGER };
+
+// One attribute of an interleaved vertex struct
+struct VertexAttrib
+{
+    const char* name;
+    int size;
+    GLenum type;
+    AttribMode mode;
+    size_t offset;
+
+    constexpr VertexAttrib(const char* name, int size, GLenum type, AttribMode mode, size_t offset)
+      : name(name), size(size), type(type), mode(mode), offset(offset) {}
+};
+
+template<typename T>
+constexpr VertexAttrib vertexAttrib(const char* name, AttribMode mode, size_t offset)
+{
+    static_assert(AttribFormat<T>::count > 0, "unsupported vertex attribute type");
+    return VertexAttrib(name, AttribFormat<T>::count, GLComponentType<typename AttribFormat<T>::component>::value, mode, offset);
+}
+
+// Describe the member 'member' of the struct 'Vertex' as the shader input 'name'
+#define VERTEX_ATTRIB(Vertex, member, name, mode) \
+  vertexAttrib<decltype(Vertex::member)>(name, mode, offsetof(Vertex, member))
+
+///
+/// Compile-time layout of an interleaved vertex struct, to be specialized as
+/// template<> struct VertexLayout<MyVertex> {
+///   static constexpr VertexAttrib attribs[] = {
+///     VERTEX_ATTRIB(MyVertex, position, "position", ATTRIB_FLOAT), ... };
+/// };
+/// constexpr VertexAttrib VertexLayout<MyVertex>::attribs[];
+///
+template<typename Vertex> struct VertexLayout;
+
 class VertexBufferObject
 {
 public:
@@ -69,24 +195,59 @@ public:
     GLuint rows;
     GLuint cols;
 
-    VertexBufferObject() : id(0), rows(0), cols(0) {}
+    // Allocated storage in bytes, at least cols elements of element_size bytes
+    size_t capacity;
+    size_t element_size;
+
+    VertexBufferObject() : id(0), rows(0), cols(0), capacity(0), element_size(0) {}
 
     // Create a new empty VBO
     void init();
 
-    // Updates the VBO
+    // Updates the VBO, the storage is only reallocated when the array does not fit
     template<typename T>
     void update(const std::vector<T>& array)
     {
       assert(id != 0);
       assert(!array.empty()); 
-      glBindBuffer(GL_ARRAY_BUFFER, id);
-      glBufferData(GL_ARRAY_BUFFER, sizeof(T) * array.size(), array.data(), GL_DYNAMIC_DRAW);
+      reserve(sizeof(T) * array.size());
+      glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(T) * array.size(), array.data());
       cols = array.size();
-      rows = array[0].length();
+      rows = AttribFormat<T>::count;
+      element_size = sizeof(T);
       check_gl_error();
     };
 
+    // Updates the elements [first, first + count) of the VBO and returns the number of uploaded bytes
+    // If the array outgrew the storage, the whole array is uploaded instead
+    template<typename T>
+    size_t update(const std::vector<T>& array, size_t first, size_t count)
+    {
+      assert(id != 0);
+      assert(first + count <= array.size());
+      if (sizeof(T) * array.size() > capacity)
+      {
+        update(array);
+        return sizeof(T) * array.size();
+      }
+      cols = array.size();
+      rows = AttribFormat<T>::count;
+      element_size = sizeof(T);
+      if (count == 0)
+        return 0;
+      GLState::current().bindBuffer(GL_ARRAY_BUFFER, id);
+      glBufferSubData(GL_ARRAY_BUFFER, sizeof(T) * first, sizeof(T) * count, array.data() + first);
+      check_gl_error();
+      return sizeof(T) * count;
+    };
+
+    // Bind the VBO and grow its storage geometrically to hold at least size bytes
+    // The previous content is discarded when the storage grows
+    void reserve(size_t size);
+
+    // Release the storage past the current cols elements, keeping their content
+    void shrink();
+
     // Select this VBO for subsequent draw calls
     void bind();
 
@@ -94,6 +255,180 @@ public:
     void free();
 };
 
+// A ring of 'frames' regions of vertex storage that stays mapped, so that each
+// frame writes its vertices straight into GPU memory without a staging vector.
+// Every region is fenced once drawn and only rewritten after the GPU read it.
+class StreamingBuffer
+{
+public:
+    typedef unsigned int GLuint;
+
+    GLuint id;
+    GLuint frames;
+    GLuint current;
+    size_t region_size;
+
+    // True when the storage is persistently mapped (GL_ARB_buffer_storage),
+    // otherwise each region is mapped with glMapBufferRange
+    bool persistent;
+    char* mapped;
+    std::vector<GLsync> fences;
+
+    // Number of times map() had to wait for the GPU
+    GLuint stalls;
+
+    StreamingBuffer() : id(0), frames(0), current(0), region_size(0), persistent(false), mapped(NULL), stalls(0) {}
+
+    // Create a ring of frames regions of at least size bytes each
+    void init(size_t size, GLuint frames = 3);
+
+    // Grow the regions geometrically to hold at least size bytes
+    void reserve(size_t size);
+
+    // Wait until the GPU released the current region and return a pointer to write it
+    void* map();
+
+    template<typename T>
+    T* map() { return static_cast<T*>(map()); }
+
+    // Finish the writes to the current region and return its offset in bytes
+    size_t unmap();
+
+    // Fence the current region after the draw calls reading it and move to the next one
+    void advance();
+
+    // Fence the last region again after more draw calls reading it, without writing a new one
+    void retain();
+
+    // Release the id and the fences
+    void free();
+
+private:
+    void wait(GLuint region);
+};
+
+// Texture reading the storage of a buffer with texelFetch (samplerBuffer in GLSL)
+class BufferTexture
+{
+public:
+    typedef unsigned int GLuint;
+
+    GLuint id;
+
+    BufferTexture() : id(0) {}
+
+    // Create a texture over the storage of buffer, made of texels of internal_format (e.g. GL_RGBA32F)
+    // The texture follows the buffer when its storage is reallocated
+    void init(GLenum internal_format, GLuint buffer);
+
+    // Select this texture on the texture unit 'unit'
+    void bind(GLuint unit);
+
+    // Release the id
+    void free();
+};
+
+// Offscreen render target with an RGBA8 color renderbuffer and a 24-bit depth
+// renderbuffer, for rendering without a window
+class FramebufferObject
+{
+public:
+    typedef unsigned int GLuint;
+
+    GLuint id;
+    GLuint color;
+    GLuint depth;
+    int width;
+    int height;
+
+    FramebufferObject() : id(0), color(0), depth(0), width(0), height(0) {}
+
+    // Create a new framebuffer of width x height pixels, false if it is incomplete
+    bool init(int width, int height);
+
+    // Select this framebuffer for subsequent draw calls and set the viewport to cover it
+    void bind();
+
+    // Read back the color buffer as tightly packed RGB rows, top row first
+    void readPixels(std::vector<unsigned char>& rgb) const;
+
+    // Release the ids
+    void free();
+};
+
+// Offscreen render target with one texture per color attachment, for passes
+// whose output is sampled by a later pass
+class TextureFramebuffer
+{
+public:
+    typedef unsigned int GLuint;
+
+    GLuint id;
+    std::vector<GLuint> textures;
+    // 24-bit depth renderbuffer, 0 if there is none
+    GLuint depth;
+    int width;
+    int height;
+
+    TextureFramebuffer() : id(0), depth(0), width(0), height(0) {}
+
+    // Create a new framebuffer of width x height pixels, with the color attachment i
+    // of the format internal_formats[i] (e.g. GL_RGBA16F or GL_R32UI) and a depth
+    // buffer if with_depth is set, false if it is incomplete
+    bool init(int width, int height, const std::vector<GLenum>& internal_formats, bool with_depth = false);
+
+    // Select this framebuffer, drawing into every attachment, and set the viewport to cover it
+    void bind();
+
+    // Bind the texture of attachment i to the texture unit first_unit + i
+    void bindTextures(GLuint first_unit) const;
+
+    // Release the ids
+    void free();
+};
+
+// Asynchronous readback of single pixels of an unsigned integer color buffer
+// (e.g. GL_R32UI): read() queues the copy of a pixel into a pixel buffer and
+// fences it, value() returns it, without waiting once the GPU got that far
+class PixelReadback
+{
+public:
+    typedef unsigned int GLuint;
+
+    GLuint buffer;
+    GLsync fence;
+    // Pixel of the last read, -1 if there is none
+    int x;
+    int y;
+    GLuint result;
+
+    // Number of times value() had to wait for the GPU
+    GLuint stalls;
+
+    PixelReadback() : buffer(0), fence(0), x(-1), y(-1), result(0), stalls(0) {}
+
+    // Create the pixel buffer
+    void init();
+
+    // Queue the copy of the pixel (x, y) of the color attachment 'attachment' of framebuffer
+    void read(GLuint framebuffer, GLenum attachment, int x, int y);
+
+    // True if the last read was of the pixel (x, y)
+    bool has(int px, int py) const { return x == px && y == py; }
+
+    // Value of the pixel of the last read, waiting for the GPU if it did not copy it yet
+    GLuint value();
+
+    // Forget the last read, e.g. once the framebuffer was drawn again
+    void discard() { x = y = -1; }
+
+    // Release the id and the fence
+    void free();
+};
+
+// Write tightly packed RGB rows, top row first, as a binary PPM image
+bool write_ppm(const std::string& path, int width, int height, const std::vector<unsigned char>& rgb);
+
 // This class wraps an OpenGL program composed of two shaders
 class Program
 {
@@ -105,12 +440,41 @@ public:
   GLuint fragment_shader;
   GLuint program_shader;
 
+  // Locations of the active uniforms and attributes, introspected once at link time
+  std::unordered_map<std::string, GLint> uniforms;
+  std::unordered_map<std::string, GLint> attributes;
+
   Program() : vertex_shader(0), fragment_shader(0), program_shader(0) { }
 
+  // Directory of the on-disk cache of linked program binaries (GL_ARB_get_program_binary),
+  // empty to always compile from source. The entries are keyed by the sources and
+  // the GL_RENDERER / GL_VERSION strings, rejected ones are recompiled and replaced
+  static std::string binary_cache_dir;
+  static GLuint binary_cache_hits;
+  static GLuint binary_cache_misses;
+
   // Create a new shader from the specified source strings
+  // The defines (e.g. "#define OUTLINE\n") are inserted after the #version line of both shaders,
+  // and the attributes of the layout, if any, get the locations 0, 1, ... in order
+  // fragment_data_name may list several space-separated outputs, written to the draw buffers 0, 1, ...
   bool init(const std::string &vertex_shader_string,
   const std::string &fragment_shader_string,
-  const std::string &fragment_data_name);
+  const std::string &fragment_data_name,
+  const std::string &defines = "",
+  const VertexAttrib* layout = NULL, size_t layout_size = 0);
+
+  // Same, with the attribute locations of the layout of Vertex so that
+  // every variant compiled from one source can share the same VAO
+  template<typename Vertex>
+  bool init(const std::string &vertex_shader_string,
+  const std::string &fragment_shader_string,
+  const std::string &fragment_data_name,
+  const std::string &defines)
+  {
+    typedef VertexLayout<Vertex> Layout;
+    return init(vertex_shader_string, fragment_shader_string, fragment_data_name, defines,
+      Layout::attribs, sizeof(Layout::attribs) / sizeof(VertexAttrib));
+  }
 
   // Select this shader for subsequent draw calls
   void bind();
@@ -119,14 +483,40 @@ public:
   void free();
 
   // Return the OpenGL handle of a named shader attribute (-1 if it does not exist)
+  // The handle is looked up in the cache, resolve it once outside of hot loops
   GLint attrib(const std::string &name) const;
 
   // Return the OpenGL handle of a uniform attribute (-1 if it does not exist)
+  // The handle is looked up in the cache, resolve it once outside of hot loops
   GLint uniform(const std::string &name) const;
 
   // Bind a per-vertex array attribute
   GLint bindVertexAttribArray(const std::string &name, VertexBufferObject& VBO) const;
 
+  // Bind every attribute of the interleaved layout of Vertex, starting at offset bytes in the buffer
+  // A divisor of 1 advances the attributes once per instance instead of once per vertex
+  template<typename Vertex>
+  void bindVertexLayout(GLuint buffer, size_t offset = 0, GLuint divisor = 0) const
+  {
+    typedef VertexLayout<Vertex> Layout;
+    GLState::current().bindBuffer(GL_ARRAY_BUFFER, buffer);
+    for (size_t i = 0; i < sizeof(Layout::attribs) / sizeof(VertexAttrib); ++i)
+      bindVertexAttrib(Layout::attribs[i], sizeof(Vertex), offset, divisor);
+    check_gl_error();
+  }
+
+  // Bind one attribute of an interleaved layout to the buffer bound to GL_ARRAY_BUFFER
+  GLint bindVertexAttrib(const VertexAttrib& vertex_attrib, GLint stride, size_t offset, GLuint divisor = 0) const;
+
   GLuint create_shader_helper(GLint type, const std::string &shader_string);
 
+  // Link the program from a cached binary, false if it is missing or rejected by the driver
+  bool load_binary(const std::string &path);
+
+  // Write the binary of the linked program to the cache
+  void save_binary(const std::string &path) const;
+
+  // Fill the uniform and attribute caches from the linked program
+  void introspect();
+
 };
@@ -0,0 +1,88 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <algorithm>
+
+// SSE2 is always there on x86-64, other targets use the scalar fallback
+// Defining SIMD_SCALAR forces the fallback, e.g. to test it on x86-64
+#if !defined(SIMD_SCALAR) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#  define SIMD_SSE2
+#  include <emmintrin.h>
+#endif
+
+///
+/// 4 floats processed together, e.g. an edge function over 4 pixels
+/// Comparisons return lane masks to combine with & | and select(),
+/// mask() packs them into the low 4 bits of an int (lane 0 is bit 0)
+///
+struct Float4
+{
+#ifdef SIMD_SSE2
+    __m128 v;
+
+    Float4() {}
+    Float4(__m128 v) : v(v) {}
+    explicit Float4(float s) : v(_mm_set1_ps(s)) {}
+    Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+    friend Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.v, b.v); }
+    friend Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.v, b.v); }
+    friend Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.v, b.v); }
+    friend Float4 operator&(Float4 a, Float4 b) { return _mm_and_ps(a.v, b.v); }
+    friend Float4 operator|(Float4 a, Float4 b) { return _mm_or_ps(a.v, b.v); }
+    friend Float4 operator>(Float4 a, Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+    friend Float4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+    friend Float4 operator==(Float4 a, Float4 b) { return _mm_cmpeq_ps(a.v, b.v); }
+    friend Float4 min(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+    friend Float4 max(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+
+    // Lanes of b where the mask is set, of a elsewhere
+    friend Float4 select(Float4 mask, Float4 a, Float4 b) { return _mm_or_ps(_mm_andnot_ps(mask.v, a.v), _mm_and_ps(mask.v, b.v)); }
+
+    static Float4 load(const float* in) { return _mm_loadu_ps(in); }
+    int mask() const { return _mm_movemask_ps(v); }
+    void store(float* out) const { _mm_storeu_ps(out, v); }
+#else
+    float v[4];
+
+    Float4() {}
+    explicit Float4(float s) { v[0] = v[1] = v[2] = v[3] = s; }
+    Float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+
+    // Masks are all-ones (-1 as int) or zero lanes, like SSE
+    static float bits(bool b) { union { int i; float f; } u; u.i = b ? -1 : 0; return u.f; }
+    static int asInt(float f) { union { int i; float f; } u; u.f = f; return u.i; }
+
+    template<typename Op>
+    static Float4 apply(Float4 a, Float4 b, Op op) { return Float4(op(a.v[0], b.v[0]), op(a.v[1], b.v[1]), op(a.v[2], b.v[2]), op(a.v[3], b.v[3])); }
+
+    friend Float4 operator+(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return x + y; }); }
+    friend Float4 operator-(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return x - y; }); }
+    friend Float4 operator*(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return x * y; }); }
+    friend Float4 operator&(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return bits(asInt(x) & asInt(y)); }); }
+    friend Float4 operator|(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return bits(asInt(x) | asInt(y)); }); }
+    friend Float4 operator>(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return bits(x > y); }); }
+    friend Float4 operator>=(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return bits(x >= y); }); }
+    friend Float4 operator==(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return bits(x == y); }); }
+    friend Float4 min(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return std::min(x, y); }); }
+    friend Float4 max(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return std::max(x, y); }); }
+
+    friend Float4 select(Float4 mask, Float4 a, Float4 b)
+    {
+        Float4 r;
+        for (int i = 0; i < 4; ++i) r.v[i] = asInt(mask.v[i]) ? b.v[i] : a.v[i];
+        return r;
+    }
+
+    static Float4 load(const float* in) { return Float4(in[0], in[1], in[2], in[3]); }
+    int mask() const { return (asInt(v[0]) < 0) | (asInt(v[1]) < 0) << 1 | (asInt(v[2]) < 0) << 2 | (asInt(v[3]) < 0) << 3; }
+    void store(float* out) const { std::copy(v, v + 4, out); }
+#endif
+
+    // 0, 1, 2, 3
+    static Float4 lanes() { return Float4(0.0f, 1.0f, 2.0f, 3.0f); }
+
+    friend Float4 clamp(Float4 x, Float4 lo, Float4 hi) { return min(max(x, lo), hi); }
+};
+
+#endif
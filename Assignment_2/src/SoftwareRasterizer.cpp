@@ -0,0 +1,236 @@
+#include "SoftwareRasterizer.h"
+#include "Simd.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <thread>
+
+// Run f(worker) on 'count' threads, the calling thread being worker 0
+template<typename F>
+static void runWorkers(unsigned count, F f)
+{
+    std::vector<std::thread> threads;
+    for (unsigned worker = 1; worker < count; ++worker)
+        threads.push_back(std::thread(f, worker));
+    f(0);
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+}
+
+SoftwareRasterizer::SoftwareRasterizer(int width, int height, unsigned threads)
+  : w(width), h(height)
+{
+    tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+    tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+    workers = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+    framebuffer.resize(size_t(w) * h * 3);
+    bins.resize(workers, std::vector<std::vector<unsigned> >(tilesX * tilesY));
+}
+
+bool SoftwareRasterizer::setup(const RasterTriangle& triangle, const glm::mat4& view, Setup& out) const
+{
+    // Window coordinates, y up like GL
+    glm::vec2 p[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        glm::vec4 clip = view * glm::vec4(triangle.position[k], 0.0f, 1.0f);
+        p[k] = glm::vec2((clip.x / clip.w + 1.0f) * 0.5f * w, (clip.y / clip.w + 1.0f) * 0.5f * h);
+    }
+
+    float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
+    if (!(std::abs(area) > 0.0f) || !std::isfinite(area))
+        return false;
+
+    // Counter-clockwise order, so that the inside is where all the edge functions are positive
+    int order[3] = { 0, 1, 2 };
+    if (area < 0.0f)
+    {
+        std::swap(order[1], order[2]);
+        area = -area;
+    }
+
+    glm::vec2 lo = p[0], hi = p[0];
+    for (int k = 0; k < 3; ++k)
+    {
+        glm::vec2 v1 = p[order[(k + 1) % 3]];
+        glm::vec2 v2 = p[order[(k + 2) % 3]];
+        out.a[k] = v1.y - v2.y;
+        out.b[k] = v2.x - v1.x;
+        out.c[k] = -(out.a[k] * v1.x + out.b[k] * v1.y);
+        out.invLength[k] = 1.0f / glm::length(v2 - v1);
+        out.topLeft[k] = (v1.y == v2.y && v2.x < v1.x) || v2.y < v1.y;
+        out.color[k] = triangle.color[order[k]];
+
+        lo = glm::min(lo, p[k]);
+        hi = glm::max(hi, p[k]);
+    }
+    out.invArea = 1.0f / area;
+    out.fill = triangle.fill;
+    out.outline = triangle.outline;
+
+    // Pixels whose center may be inside, clipped to the framebuffer
+    out.xmin = std::max(0, int(std::floor(lo.x)));
+    out.ymin = std::max(0, int(std::floor(lo.y)));
+    out.xmax = std::min(w, int(std::ceil(hi.x)) + 1);
+    out.ymax = std::min(h, int(std::ceil(hi.y)) + 1);
+    return out.xmin < out.xmax && out.ymin < out.ymax;
+}
+
+void SoftwareRasterizer::binTriangles(const std::vector<RasterTriangle>& triangles, const glm::mat4& view, unsigned worker)
+{
+    std::vector<std::vector<unsigned> >& tiles = bins[worker];
+    for (size_t t = 0; t < tiles.size(); ++t)
+        tiles[t].clear();
+
+    // Each worker bins a contiguous slice, the tiles read the slices in order
+    size_t first = triangles.size() * worker / workers;
+    size_t last = triangles.size() * (worker + 1) / workers;
+    for (size_t i = first; i < last; ++i)
+    {
+        Setup& s = setups[i];
+        if (!setup(triangles[i], view, s))
+            continue;
+        for (int ty = s.ymin / TILE_SIZE; ty <= (s.ymax - 1) / TILE_SIZE; ++ty)
+            for (int tx = s.xmin / TILE_SIZE; tx <= (s.xmax - 1) / TILE_SIZE; ++tx)
+                tiles[ty * tilesX + tx].push_back(i);
+    }
+}
+
+size_t SoftwareRasterizer::rasterizeTile(size_t tile, const glm::vec3& clear)
+{
+    int x0 = int(tile % tilesX) * TILE_SIZE;
+    int y0 = int(tile / tilesX) * TILE_SIZE;
+    int x1 = std::min(w, x0 + TILE_SIZE);
+    int y1 = std::min(h, y0 + TILE_SIZE);
+
+    unsigned char background[3];
+    for (int i = 0; i < 3; ++i)
+        background[i] = (unsigned char) (glm::clamp(clear[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+    for (int y = y0; y < y1; ++y)
+    {
+        unsigned char* row = &framebuffer[(size_t(h - 1 - y) * w + x0) * 3];
+        for (int x = x0; x < x1; ++x, row += 3)
+            std::copy(background, background + 3, row);
+    }
+
+    size_t pixels = 0;
+    for (unsigned worker = 0; worker < workers; ++worker)
+    {
+        const std::vector<unsigned>& triangles = bins[worker][tile];
+        for (size_t i = 0; i < triangles.size(); ++i)
+        {
+            const Setup& s = setups[triangles[i]];
+            pixels += rasterizeTriangle(s, std::max(x0, s.xmin), std::max(y0, s.ymin), std::min(x1, s.xmax), std::min(y1, s.ymax));
+        }
+    }
+    return pixels;
+}
+
+size_t SoftwareRasterizer::rasterizeTriangle(const Setup& s, int x0, int y0, int x1, int y1)
+{
+    const Float4 zero(0.0f), one(1.0f), half(0.5f);
+    Float4 a[3], topLeft[3], invLength[3];
+    for (int k = 0; k < 3; ++k)
+    {
+        a[k] = Float4(s.a[k]);
+        topLeft[k] = s.topLeft[k] ? (zero == zero) : (zero > zero);
+        invLength[k] = Float4(s.invLength[k]);
+    }
+    Float4 invArea(s.invArea);
+    Float4 width(s.outline.w);
+    Float4 widthCoverage(std::min(s.outline.w, 1.0f));
+    Float4 fillBlend(s.fill.w);
+
+    size_t pixels = 0;
+    float out[3][4];
+    for (int y = y0; y < y1; ++y)
+    {
+        float py = y + 0.5f;
+        Float4 row[3];
+        for (int k = 0; k < 3; ++k)
+            row[k] = Float4(s.b[k] * py + s.c[k]);
+
+        unsigned char* line = &framebuffer[size_t(h - 1 - y) * w * 3];
+        for (int x = x0; x < x1; x += 4)
+        {
+            // Edge functions at the centers of 4 pixels
+            Float4 px = Float4(x + 0.5f) + Float4::lanes();
+            Float4 e[3];
+            Float4 inside = (zero == zero);
+            for (int k = 0; k < 3; ++k)
+            {
+                e[k] = a[k] * px + row[k];
+                inside = inside & ((e[k] > zero) | ((e[k] == zero) & topLeft[k]));
+            }
+            int mask = inside.mask() & ((1 << std::min(4, x1 - x)) - 1);
+            if (!mask)
+                continue;
+
+            // Same as the vertex and fragment shaders: interpolated color, blended
+            // with the fill, then with the outline within its width of an edge
+            Float4 bary[3] = { e[0] * invArea, e[1] * invArea, e[2] * invArea };
+            Float4 distance = min(min(e[0] * invLength[0], e[1] * invLength[1]), e[2] * invLength[2]);
+            Float4 coverage = clamp(width - distance + half, zero, one) * widthCoverage;
+            for (int c = 0; c < 3; ++c)
+            {
+                Float4 color = bary[0] * Float4(s.color[0][c]) + bary[1] * Float4(s.color[1][c]) + bary[2] * Float4(s.color[2][c]);
+                color = color + (Float4(s.fill[c]) - color) * fillBlend;
+                color = color + (Float4(s.outline[c]) - color) * coverage;
+                clamp(color, zero, one).store(out[c]);
+            }
+
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!(mask & (1 << i)))
+                    continue;
+                unsigned char* pixel = line + (x + i) * 3;
+                for (int c = 0; c < 3; ++c)
+                    pixel[c] = (unsigned char) (out[c][i] * 255.0f + 0.5f);
+                ++pixels;
+            }
+        }
+    }
+    return pixels;
+}
+
+void SoftwareRasterizer::render(const std::vector<RasterTriangle>& triangles, const glm::mat4& view, const glm::vec3& clear)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    setups.resize(triangles.size());
+    runWorkers(workers, [&](unsigned worker) { binTriangles(triangles, view, worker); });
+
+    // The tiles are dealt out in contiguous ranges, one per worker. A worker
+    // that finished its own range steals the remaining tiles of the others.
+    struct TileRange
+    {
+        std::atomic<size_t> next;
+        size_t end;
+    };
+    size_t tiles = size_t(tilesX) * tilesY;
+    std::unique_ptr<TileRange[]> ranges(new TileRange[workers]);
+    for (unsigned worker = 0; worker < workers; ++worker)
+    {
+        ranges[worker].next = tiles * worker / workers;
+        ranges[worker].end = tiles * (worker + 1) / workers;
+    }
+
+    std::atomic<size_t> pixels(0);
+    runWorkers(workers, [&](unsigned worker)
+    {
+        size_t shaded = 0;
+        for (unsigned k = 0; k < workers; ++k)
+        {
+            TileRange& range = ranges[(worker + k) % workers];
+            for (size_t tile = range.next++; tile < range.end; tile = range.next++)
+                shaded += rasterizeTile(tile, clear);
+        }
+        pixels += shaded;
+    });
+
+    stats.triangles = triangles.size();
+    stats.pixels = pixels;
+    stats.seconds = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::high_resolution_clock::now() - start).count();
+}
@@ -0,0 +1,88 @@
+#ifndef SOFTWARE_RASTERIZER_H
+#define SOFTWARE_RASTERIZER_H
+
+#include <vector>
+#include <cstddef>
+#include <glm/glm.hpp>
+#include <glm/mat4x4.hpp>
+
+// Triangle as drawn by the batched renderer, in world coordinates
+struct RasterTriangle
+{
+    glm::vec2 position[3];
+    glm::vec3 color[3];
+    // Fill color, alpha blends from the vertex colors (0) to it (1)
+    glm::vec4 fill;
+    // Outline color, alpha is the outline width in pixels (selection already applied)
+    glm::vec4 outline;
+};
+
+///
+/// CPU renderer producing the image of the GL pipeline without any GL stack:
+/// Gouraud-interpolated vertex colors and outlines from the distance to the edges.
+/// The triangles are binned into tiles of TILE_SIZE pixels, then the tiles are
+/// rasterized in parallel, 4 pixels at a time, with the scene order kept in each tile.
+///
+class SoftwareRasterizer
+{
+public:
+    static const int TILE_SIZE = 64;
+
+    // Counters of the last render()
+    struct Stats
+    {
+        size_t triangles;
+        size_t pixels;
+        double seconds;
+
+        Stats() : triangles(0), pixels(0), seconds(0) {}
+    };
+
+    // Framebuffer of width x height pixels, rendered by 'threads' threads (0 for one per core)
+    SoftwareRasterizer(int width, int height, unsigned threads = 0);
+
+    // Clear the framebuffer and draw the triangles in order, view maps world to clip coordinates
+    void render(const std::vector<RasterTriangle>& triangles, const glm::mat4& view, const glm::vec3& clear);
+
+    // Framebuffer as tightly packed RGB rows, top row first
+    const std::vector<unsigned char>& pixels() const { return framebuffer; }
+
+    int width() const { return w; }
+    int height() const { return h; }
+    unsigned threads() const { return workers; }
+
+    Stats stats;
+
+private:
+    // Edge functions and shading inputs of a triangle in window coordinates (y up),
+    // E_k(x, y) = a[k] * x + b[k] * y + c[k] is 0 on the edge opposite to vertex k
+    // and the area (times 2) on vertex k
+    struct Setup
+    {
+        float a[3], b[3], c[3];
+        // 1 / area, and 1 / length of the edges to get distances in pixels
+        float invArea;
+        float invLength[3];
+        // Pixels on the edge belong to the triangle on top and left edges only
+        bool topLeft[3];
+        int xmin, ymin, xmax, ymax;
+        glm::vec3 color[3];
+        glm::vec4 fill;
+        glm::vec4 outline;
+    };
+
+    int w, h;
+    int tilesX, tilesY;
+    unsigned workers;
+    std::vector<unsigned char> framebuffer;
+    std::vector<Setup> setups;
+    // Triangles overlapping each tile, one list per binning thread to keep the order
+    std::vector<std::vector<std::vector<unsigned> > > bins;
+
+    bool setup(const RasterTriangle& triangle, const glm::mat4& view, Setup& out) const;
+    void binTriangles(const std::vector<RasterTriangle>& triangles, const glm::mat4& view, unsigned worker);
+    size_t rasterizeTile(size_t tile, const glm::vec3& clear);
+    size_t rasterizeTriangle(const Setup& s, int x0, int y0, int x1, int y1);
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "SpatialGrid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+static bool overlaps(glm::vec2 lo0, glm::vec2 hi0, glm::vec2 lo1, glm::vec2 hi1)
+{
+    return lo0.x <= hi1.x && lo1.x <= hi0.x && lo0.y <= hi1.y && lo1.y <= hi0.y;
+}
+
+SpatialGrid::SpatialGrid(float cellSize)
+  : cellSize(cellSize), stamp(0)
+{
+}
+
+int SpatialGrid::cellOf(float v) const
+{
+    // Far away coordinates share the border cells instead of overflowing
+    float c = std::floor(v / cellSize);
+    return int(std::max(-1e9f, std::min(1e9f, c)));
+}
+
+void SpatialGrid::link(unsigned id)
+{
+    Item& item = items[id];
+    item.x0 = cellOf(item.lo.x);
+    item.y0 = cellOf(item.lo.y);
+    item.x1 = cellOf(item.hi.x);
+    item.y1 = cellOf(item.hi.y);
+
+    double count = (double(item.x1) - item.x0 + 1) * (double(item.y1) - item.y0 + 1);
+    item.oversized = count > MAX_ITEM_CELLS;
+    if (item.oversized)
+    {
+        item.x1 = item.x0 - 1;
+        oversized.push_back(id);
+        return;
+    }
+
+    Entry entry;
+    entry.lo = item.lo;
+    entry.hi = item.hi;
+    entry.id = id;
+    for (int y = item.y0; y <= item.y1; ++y)
+        for (int x = item.x0; x <= item.x1; ++x)
+            cells[key(x, y)].push_back(entry);
+}
+
+void SpatialGrid::unlink(unsigned id)
+{
+    Item& item = items[id];
+    if (item.oversized)
+    {
+        oversized.erase(std::find(oversized.begin(), oversized.end(), id));
+        item.oversized = false;
+        return;
+    }
+
+    for (int y = item.y0; y <= item.y1; ++y)
+    {
+        for (int x = item.x0; x <= item.x1; ++x)
+        {
+            auto found = cells.find(key(x, y));
+            std::vector<Entry>& entries = found->second;
+            size_t i = 0;
+            while (entries[i].id != id)
+                ++i;
+            entries[i] = entries.back();
+            entries.pop_back();
+            if (entries.empty())
+                cells.erase(found);
+        }
+    }
+    item.x1 = item.x0 - 1;
+}
+
+void SpatialGrid::update(unsigned id, glm::vec2 lo, glm::vec2 hi)
+{
+    // New items are not linked and overlap nothing until their box is set
+    while (items.size() <= id)
+    {
+        Item item;
+        item.lo = glm::vec2(std::numeric_limits<float>::max());
+        item.hi = glm::vec2(-std::numeric_limits<float>::max());
+        item.x0 = item.y0 = item.y1 = 0;
+        item.x1 = -1;
+        item.oversized = false;
+        items.push_back(item);
+    }
+
+    unlink(id);
+    items[id].lo = lo;
+    items[id].hi = hi;
+    link(id);
+}
+
+void SpatialGrid::fitCells()
+{
+    double extent = 0.0;
+    size_t count = 0;
+    for (size_t id = 0; id < items.size(); ++id)
+    {
+        glm::vec2 size = items[id].hi - items[id].lo;
+        if (!(size.x >= 0.0f && size.y >= 0.0f) || !std::isfinite(size.x + size.y))
+            continue;
+        extent += std::max(size.x, size.y);
+        ++count;
+    }
+    if (count == 0 || !(extent > 0.0))
+        return;
+
+    cells.clear();
+    oversized.clear();
+    cellSize = float(extent / count);
+    for (size_t id = 0; id < items.size(); ++id)
+    {
+        if (items[id].lo.x <= items[id].hi.x)
+            link(id);
+    }
+}
+
+void SpatialGrid::resize(size_t count)
+{
+    for (size_t id = count; id < items.size(); ++id)
+        unlink(id);
+    if (count < items.size())
+        items.resize(count);
+}
+
+void SpatialGrid::query(glm::vec2 lo, glm::vec2 hi, std::vector<unsigned>& out) const
+{
+    out.clear();
+    int x0 = cellOf(lo.x), y0 = cellOf(lo.y), x1 = cellOf(hi.x), y1 = cellOf(hi.y);
+
+    // A query covering more cells than are occupied is cheaper as a scan of the items
+    double count = (double(x1) - x0 + 1) * (double(y1) - y0 + 1);
+    if (count > double(cells.size()))
+    {
+        for (size_t id = 0; id < items.size(); ++id)
+            if (overlaps(items[id].lo, items[id].hi, lo, hi))
+                out.push_back(id);
+        return;
+    }
+
+    // An item is listed once per cell, a query of one cell (e.g. a point) has nothing to deduplicate
+    bool single = x0 == x1 && y0 == y1;
+    if (!single)
+    {
+        stamps.resize(items.size(), 0);
+        if (++stamp == 0)
+        {
+            std::fill(stamps.begin(), stamps.end(), 0);
+            stamp = 1;
+        }
+    }
+
+    for (int y = y0; y <= y1; ++y)
+    {
+        for (int x = x0; x <= x1; ++x)
+        {
+            auto found = cells.find(key(x, y));
+            if (found == cells.end())
+                continue;
+            const std::vector<Entry>& entries = found->second;
+            for (size_t i = 0; i < entries.size(); ++i)
+            {
+                const Entry& entry = entries[i];
+                if (!overlaps(entry.lo, entry.hi, lo, hi))
+                    continue;
+                if (!single)
+                {
+                    if (stamps[entry.id] == stamp)
+                        continue;
+                    stamps[entry.id] = stamp;
+                }
+                out.push_back(entry.id);
+            }
+        }
+    }
+    for (size_t i = 0; i < oversized.size(); ++i)
+        if (overlaps(items[oversized[i]].lo, items[oversized[i]].hi, lo, hi))
+            out.push_back(oversized[i]);
+
+    std::sort(out.begin(), out.end());
+}
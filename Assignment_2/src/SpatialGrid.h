@@ -0,0 +1,76 @@
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+///
+/// Uniform grid of square cells over the plane, indexing items 0..size()-1 by
+/// their bounding box. Only the occupied cells are stored (hashed), an item is
+/// listed in every cell its box overlaps, or kept aside if it spans too many.
+///
+class SpatialGrid
+{
+public:
+    // Items overlapping more cells than this are not inserted in the cells
+    static const int MAX_ITEM_CELLS = 64;
+
+    explicit SpatialGrid(float cellSize = 0.25f);
+
+    // Set the bounding box of item id, adding the items up to id as needed
+    void update(unsigned id, glm::vec2 lo, glm::vec2 hi);
+
+    // Remove the items id >= count
+    void resize(size_t count);
+
+    size_t size() const { return items.size(); }
+
+    // Side of the cells, the items are listed in the cells of their box
+    float cell() const { return cellSize; }
+
+    // Resize the cells to the mean extent of the boxes, so that an item
+    // spans a few cells and a cell lists a few items, and relink the items
+    void fitCells();
+
+    // Bounding box of item id
+    glm::vec2 lower(unsigned id) const { return items[id].lo; }
+    glm::vec2 upper(unsigned id) const { return items[id].hi; }
+
+    // Replace out with the ids of the items whose box overlaps [lo, hi], in increasing order
+    void query(glm::vec2 lo, glm::vec2 hi, std::vector<unsigned>& out) const;
+
+private:
+    struct Item
+    {
+        glm::vec2 lo, hi;
+        // Range of cells the item is listed in, empty if it is not
+        int x0, y0, x1, y1;
+        bool oversized;
+    };
+
+    // Copy of the box of an item in a cell, so that a cell is scanned without touching the items
+    struct Entry
+    {
+        glm::vec2 lo, hi;
+        unsigned id;
+    };
+
+    float cellSize;
+    std::vector<Item> items;
+    std::unordered_map<uint64_t, std::vector<Entry> > cells;
+    std::vector<unsigned> oversized;
+
+    // Last query stamp of each item, to report the items listed in several cells once
+    mutable std::vector<unsigned> stamps;
+    mutable unsigned stamp;
+
+    static uint64_t key(int x, int y) { return (uint64_t(uint32_t(x)) << 32) | uint32_t(y); }
+    int cellOf(float v) const;
+
+    void link(unsigned id);
+    void unlink(unsigned id);
+};
+
+#endif
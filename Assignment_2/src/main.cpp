@@ -2,6 +2,10 @@
 
 // OpenGL Helpers to reduce the clutter
 #include "Helpers.h"
+#include "SoftwareRasterizer.h"
+#include "SpatialGrid.h"
+#include "Bvh.h"
+#include "EdgeTable.h"
 
 #ifdef __APPLE__
 #define GL_SILENCE_DEPRECATION
@@ -20,30 +24,246 @@
 #include <glm/gtc/matrix_transform.hpp> // glm::translate, glm::rotate, glm::scale, glm::perspective
 
 #include <glm/gtc/type_ptr.hpp> // glm::value_ptr
+#include <glm/gtc/constants.hpp> // glm::two_pi
 
 // Timer
 #include <chrono>
+#include <limits>
+#include <unordered_map>
 
 // Algorithms 
 #include <algorithm>
 #include <utility>
 #include <iterator>
 
+// Command line and random scenes
+#include <cstring>
+#include <cstdlib>
+#include <random>
+
+// Interleaved vertex as stored on the GPU
+struct GpuVertex {
+    glm::vec2 position;
+    glm::vec3 color;
+    // Fill color of the triangle, alpha blends from the vertex color (0) to it (1)
+    glm::vec4 fill;
+    // Outline color of the triangle, alpha is the outline width in pixels
+    glm::vec4 outline;
+    // 1 if the triangle is selected, its outline is then drawn with selectedOutline
+    GLfloat selected;
+    // Opacity of the triangle, below 1 it is drawn by the translucent pass
+    GLfloat opacity;
+};
+
+template<> struct VertexLayout<GpuVertex> {
+    static constexpr VertexAttrib attribs[] = {
+        VERTEX_ATTRIB(GpuVertex, position, "position", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuVertex, color, "color", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuVertex, fill, "fill", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuVertex, outline, "outline", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuVertex, selected, "selected", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuVertex, opacity, "opacity", ATTRIB_FLOAT)
+    };
+};
+constexpr VertexAttrib VertexLayout<GpuVertex>::attribs[];
+
+// Per-instance shape of a triangle for the instanced renderer,
+// only uploaded when its vertices or colors change
+struct GpuShape {
+    // Vertices relative to the barycenter
+    glm::vec2 rest0;
+    glm::vec2 rest1;
+    glm::vec2 rest2;
+    glm::vec3 color0;
+    glm::vec3 color1;
+    glm::vec3 color2;
+    glm::vec4 fill;
+    glm::vec4 outline;
+    GLfloat selected;
+};
+
+template<> struct VertexLayout<GpuShape> {
+    static constexpr VertexAttrib attribs[] = {
+        VERTEX_ATTRIB(GpuShape, rest0, "rest0", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuShape, rest1, "rest1", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuShape, rest2, "rest2", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuShape, color0, "color0", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuShape, color1, "color1", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuShape, color2, "color2", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuShape, fill, "fill", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuShape, outline, "outline", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuShape, selected, "selected", ATTRIB_FLOAT)
+    };
+};
+constexpr VertexAttrib VertexLayout<GpuShape>::attribs[];
+
+// Per-instance transform, the only upload when a triangle is moved, rotated or scaled
+struct GpuTransform {
+    glm::vec2 offset;
+    GLfloat angle;
+    GLfloat scale;
+};
+
+template<> struct VertexLayout<GpuTransform> {
+    static constexpr VertexAttrib attribs[] = {
+        VERTEX_ATTRIB(GpuTransform, offset, "offset", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuTransform, angle, "angle", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(GpuTransform, scale, "scale", ATTRIB_FLOAT)
+    };
+};
+constexpr VertexAttrib VertexLayout<GpuTransform>::attribs[];
+
+// Packed vertex of the quantized batched renderer, 8 bytes instead of the 20 of
+// a float position and color, the outline of the triangle is kept apart (PackedOutlines)
+struct PackedVertex {
+    // Fixed point position in the bounds of the chunk of its triangle
+    glm::u16vec2 position;
+    // Vertex color already mixed with the fill color of the triangle, the high bit
+    // of alpha is set if the triangle is selected, the low 7 bits are its opacity
+    glm::u8vec4 color;
+};
+
+template<> struct VertexLayout<PackedVertex> {
+    static constexpr VertexAttrib attribs[] = {
+        VERTEX_ATTRIB(PackedVertex, position, "position", ATTRIB_NORMALIZED),
+        VERTEX_ATTRIB(PackedVertex, color, "color", ATTRIB_NORMALIZED)
+    };
+};
+constexpr VertexAttrib VertexLayout<PackedVertex>::attribs[];
+
+// Averaged color of the sub-pixel triangles in a square cell of the screen
+struct LodPoint {
+    glm::vec2 position;
+    // Area weighted color of the triangles, alpha is the fraction of the cell they cover times their opacity
+    glm::vec4 color;
+    // Index of the last of the triangles, the point takes its place in the scene order
+    GLfloat triangle;
+};
+
+template<> struct VertexLayout<LodPoint> {
+    static constexpr VertexAttrib attribs[] = {
+        VERTEX_ATTRIB(LodPoint, position, "position", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(LodPoint, color, "color", ATTRIB_FLOAT),
+        VERTEX_ATTRIB(LodPoint, triangle, "triangle", ATTRIB_FLOAT)
+    };
+};
+constexpr VertexAttrib VertexLayout<LodPoint>::attribs[];
+
 // VertexBufferObject wrapper
 VertexBufferObject VBO;
-VertexBufferObject VBO_C;
-
-// Contains the vertex positions
-std::vector<glm::vec2> V(3);
 
-// Contains the per-vertex color
-std::vector<glm::vec3> C(3);
+// Mapped ring of vertex storage: while an animation runs, the triangles it moves are
+// written straight into the next region and drawn from there, VBO keeps their
+// previous vertices until the animation ends
+StreamingBuffer VBO_Stream;
+
+// Contains the vertex positions and per-vertex colors
+std::vector<GpuVertex> V(3);
+
+// Instanced renderer, draws every triangle as an instance of the same 3
+// vertices, transformed in the vertex shader (toggled with F3)
+bool InstancedRendering = false;
+
+// Index of the triangle bounding boxes for culling and picking: the uniform
+// grid, or the BVH for scenes of very uneven density (toggled with F5)
+bool BvhIndex = false;
+
+// GPU picking (toggled with F6): the batched renderers also draw the index + 1 of
+// each triangle into an integer framebuffer, the ID buffer, whenever the scene or
+// the view changed, and a click reads back the pixel under the cursor
+bool GpuPicking = false;
+TextureFramebuffer IdBuffer;
+PixelReadback IdReadback;
+// View and scene revision the ID buffer was drawn with, valid once it was drawn
+glm::mat4 IdBufferView;
+size_t IdBufferRevision = 0;
+bool IdBufferValid = false;
+VertexBufferObject VBO_Shapes;
+VertexBufferObject VBO_Transforms;
+std::vector<GpuShape> Shapes;
+std::vector<GpuTransform> Transforms;
+
+// Shader variants of the batched renderers, compiled from one source: the
+// fill of the triangles, with or without outline, opaque or translucent (see shaderVariant)
+enum FillMode { FILL_VERTEX_COLOR, FILL_FLAT, FILL_BLEND, FILL_MODES };
+static const size_t OPAQUE_SHADER_VARIANTS = FILL_MODES * 2;
+static const size_t SHADER_VARIANTS = OPAQUE_SHADER_VARIANTS * 2;
+// Blends the fill and draws the outline, right for every opaque triangle
+static const size_t FULL_SHADER_VARIANT = FILL_BLEND * 2 + 1;
+// Same for the translucent triangles, the only variant reading every attribute
+static const size_t LAYOUT_SHADER_VARIANT = OPAQUE_SHADER_VARIANTS + FULL_SHADER_VARIANT;
+// Triangles with a depth of their own (see triangle_depth), the later ones are drawn at
+// the nearest depth and keep the scene order only within a batch
+static const size_t DEPTH_ORDERED_TRIANGLES = size_t(1) << 23;
+
+// Translucent triangles are drawn after the opaque ones with weighted blended
+// order-independent transparency: their premultiplied colors and weights are
+// summed into OIT_ACCUMULATION, with the product of their transparencies (the
+// revealage) in its alpha, then resolved over the scene in one pass
+enum OitTarget { OIT_ACCUMULATION, OIT_WEIGHT, OIT_TARGETS };
+
+// Runs of consecutive triangles drawn by one variant, for glMultiDrawArrays
+// The batches are drawn one variant after the other, the depth written from
+// the index of each triangle puts them back in scene order
+struct VariantBatch {
+    std::vector<GLint> first;
+    std::vector<GLsizei> count;
+};
+std::vector<GLubyte> TriangleVariants;
+VariantBatch VariantBatches[SHADER_VARIANTS];
+
+// Run of the triangles [triangle, triangle + count / 3) of a variant streamed through
+// the ring, cut out of VariantBatches and drawn from the region StreamedOffset of
+// VBO_Stream, where it starts at vertex first
+struct StreamedBatch {
+    size_t variant;
+    GLint first;
+    GLsizei count;
+    GLint triangle;
+};
+std::vector<StreamedBatch> StreamedBatches;
+size_t StreamedOffset = 0;
+// Set when the last flush wrote a new region, which is fenced after the draws of the frame
+bool StreamedRegionWritten = false;
+
+// Level of detail of the batched renderers, from the size of the triangles on
+// screen: under LOD_OUTLINE_PIXELS they lose their outline, under LOD_POINT_PIXELS
+// they are merged into points of LOD_CELL_PIXELS with their averaged color
+// Both keep their place in the scene order through their depth, see VariantBatch
+static const float LOD_OUTLINE_PIXELS = 4.0f;
+static const float LOD_POINT_PIXELS = 1.0f;
+static const float LOD_CELL_PIXELS = 2.0f;
+VertexBufferObject VBO_Lod;
+std::vector<LodPoint> LodPoints;
+
+// Quantized batched renderer (toggled with F4), the triangles are grouped in
+// chunks of CHUNK_TRIANGLES consecutive triangles and their positions stored
+// as 16-bit fractions of the bounds of their chunk, read back in the vertex
+// shader from a buffer texture of (origin, extent) pairs
+// The outline of each triangle is one texel of another buffer texture, read at gl_VertexID / 3
+static const size_t CHUNK_TRIANGLES = 256;
+bool PackedVertices = false;
+VertexBufferObject VBO_Packed;
+VertexBufferObject VBO_Chunks;
+VertexBufferObject VBO_Outlines;
+BufferTexture ChunkTexture;
+BufferTexture OutlineTexture;
+std::vector<PackedVertex> PackedV;
+std::vector<glm::vec4> PackedChunks;
+// Outline color of each triangle, alpha is the outline width in 1/32 pixels
+std::vector<glm::u8vec4> PackedOutlines;
+// Largest quantization error of each chunk in world units, measured when its vertices are packed
+std::vector<float> PackedError;
 
 static const int WIN_WIDTH = 800;
 static const int WIN_HEIGHT = 600;
 static const char WIN_TITLE[] = "Triangle Soup Editor";
 static const double ANIMATION_TIME = 5;
 static const double ANIMATION_STEP = 0.01;
+// Radius of the vertex selection of the color mode, in world units, and of the
+// vertex snapping while inserting, in pixels
+static const float VERTEX_PICK_RADIUS = 0.1f;
+static const float VERTEX_SNAP_PIXELS = 8.0f;
 
 
 enum AppMode {
@@ -65,87 +285,149 @@ struct Vertex {
 
 class Triangle {
 private:
-    std::vector<Vertex> vertices;
+    // Colors of the vertices, and world-space positions cached from the rest
+    // shape and the transform until the transform changes
+    mutable std::vector<Vertex> vertices;
+    mutable bool worldValid;
     bool complete;
+
+    // Shape relative to the barycenter and transform of the triangle, the
+    // vertices are offset + rotate(angle) * scaleFactor * rest[i]
+    // Only changed through setVertex / setRest / move / rotate / scale, which keep the cache in sync
+    glm::vec2 rest[3];
+    glm::vec2 offset;
+    float angle;
+    float scaleFactor;
+
+    // Evaluate the world-space positions, once per change of the transform
+    void updateWorld() const {
+        if (worldValid) return;
+        double c = cos(angle) * scaleFactor;
+        double s = sin(angle) * scaleFactor;
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            const glm::vec2& r = rest[i];
+            vertices[i].vertex = glm::vec2(offset.x + c * r.x - s * r.y, offset.y + s * r.x + c * r.y);
+        }
+        worldValid = true;
+    }
     
 public:
     glm::vec3 fillColor;
     glm::vec3 outlineColor;
+    // 0 fills with the interpolated vertex colors, 1 with fillColor
+    float fillBlend;
+    float outlineWidth;
+    // 1 is opaque, 0 invisible
+    float opacity;
 
     Triangle(glm::vec3 fillColor = glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3 outlineColor = glm::vec3(0.0f, 0.0f, 0.0f)) {
         this->fillColor    = fillColor;
         this->outlineColor = outlineColor;
+        fillBlend          = 0.0f;
+        outlineWidth       = 1.0f;
+        opacity            = 1.0f;
+        angle              = 0.0f;
+        scaleFactor        = 1.0f;
+        worldValid         = true;
         complete           = false;
     }
 
     void addVertex(glm::vec2 v, glm::vec3 c=glm::vec3(1.0f, 1.0f, 1.0f)) {
         if (complete) return;
+        updateWorld();
         vertices.push_back(Vertex(v, c));
         complete = (vertices.size() == 3);
+        rebase();
+    }
+
+    void setVertex(size_t i, glm::vec2 v) {
+        updateWorld();
+        vertices[i].vertex = v;
+        rebase();
+    }
+
+    void setColor(size_t i, glm::vec3 c) {
+        vertices[i].color = c;
+    }
+
+    // Edit the rest shape, keeping the transform
+    void setRest(size_t i, glm::vec2 r) {
+        rest[i] = r;
+        worldValid = false;
+    }
+
+    const glm::vec2& getRest(size_t i) const { return rest[i]; }
+    float getAngle() const { return angle; }
+    float getScale() const { return scaleFactor; }
+
+    // Take the current world-space vertices as the rest shape, without rotation or scaling
+    void rebase() {
+        offset = glm::vec2(0.0f, 0.0f);
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            offset += vertices[i].vertex;
+        }
+        offset /= float(vertices.size());
+        angle = 0.0f;
+        scaleFactor = 1.0f;
+
+        // Missing vertices repeat the last one, like the batched vertices
+        for (size_t j = 0; j < 3; ++j) {
+            rest[j] = vertices[std::min(j, vertices.size() - 1)].vertex - offset;
+        }
+        worldValid = true;
     }
 
     bool isComplete() const { return complete; }
 
-    const std::vector<Vertex>& getVertices() const { return vertices; }
+    const std::vector<Vertex>& getVertices() const { updateWorld(); return vertices; }
     
     size_t size() const { return vertices.size(); }
     
-    const Vertex& operator[](size_t i) const { return vertices[i]; }
-    Vertex& operator[](size_t i) { return vertices[i]; }
+    // Read-only, edit the vertices with setVertex / setColor
+    const Vertex& operator[](size_t i) const { updateWorld(); return vertices[i]; }
 
+    // Same rule as the edge table of the scene: the boundary is inside and a triangle
+    // without area contains no point. P is on the inner side of each edge when the
+    // cross products have the sign of the area, no normalization needed
     bool isInside(glm::vec2 P) const {
         if (!isComplete()) return false;
-
-        glm::vec2 A = vertices[0].vertex;
-        glm::vec2 B = vertices[1].vertex;
-        glm::vec2 C = vertices[2].vertex;
-
-        double w1 = (A.x * (C.y - A.y) + (P.y - A.y) * (C.x - A.x) - P.x * (C.y - A.y)) / ((B.y - A.y) * (C.x - A.x) - (B.x - A.x) * (C.y - A.y));
-        double w2 = (P.y - A.y - w1 * (B.y - A.y) ) / (C.y - A.y);
-
-        return w1 >= 0 && w2 >= 0 && (w1 + w2) <= 1;
+        updateWorld();
+        const glm::vec2& v0 = vertices[0].vertex;
+        const glm::vec2& v1 = vertices[1].vertex;
+        const glm::vec2& v2 = vertices[2].vertex;
+        double area = (double(v1.x) - v0.x) * (double(v2.y) - v0.y) - (double(v1.y) - v0.y) * (double(v2.x) - v0.x);
+        if (!(std::abs(area) > 0.0) || !std::isfinite(area)) return false;
+        double e0 = (double(v1.x) - v0.x) * (double(P.y) - v0.y) - (double(v1.y) - v0.y) * (double(P.x) - v0.x);
+        double e1 = (double(v2.x) - v1.x) * (double(P.y) - v1.y) - (double(v2.y) - v1.y) * (double(P.x) - v1.x);
+        double e2 = (double(v0.x) - v2.x) * (double(P.y) - v2.y) - (double(v0.y) - v2.y) * (double(P.x) - v2.x);
+        return e0 * area >= 0.0 && e1 * area >= 0.0 && e2 * area >= 0.0;
     }
 
+    // The transforms compose into offset / angle / scaleFactor, the rest shape
+    // is never rewritten so repeated edits do not accumulate rounding errors
+
     void move(glm::vec2 delta) {
         if (!isComplete()) return;
 
-        for (size_t i = 0; i < vertices.size(); ++i) {
-            vertices[i].vertex += delta;
-        }
+        offset += delta;
+        worldValid = false;
     }
 
     glm::vec2 barycenter() const {
-        return glm::vec2(
-            (vertices[0].vertex.x + vertices[1].vertex.x + vertices[2].vertex.x) / 3.0,
-            (vertices[0].vertex.y + vertices[1].vertex.y + vertices[2].vertex.y) / 3.0
-        );
+        return offset;
     }
 
     void rotate(double angle) {
-        glm::vec2 Pc = barycenter();
-
-        double theta = glm::radians(angle);
-
-        for (size_t i = 0; i < vertices.size(); ++i) {
-            glm::vec2 P0(vertices[i].vertex.x, vertices[i].vertex.y);
-            double x1 = (P0.x - Pc.x) * cos(theta) - (P0.y - Pc.y) * sin(theta) + Pc.x;
-            double y1 = (P0.x - Pc.x) * sin(theta) + (P0.y - Pc.y) * cos(theta) + Pc.y;
-
-            vertices[i].vertex = glm::vec2(x1, y1);
-        }
+        // Wrapped to keep cos / sin of the accumulated angle accurate
+        this->angle = fmod(this->angle + glm::radians(angle), glm::two_pi<double>());
+        worldValid = false;
     }
 
     void scale(double factor) {
         if (factor <= 0.0) return;
 
-        glm::vec2 Pc = barycenter();
-
-        for (size_t i = 0; i < vertices.size(); ++i) {
-            glm::vec2 v = (vertices[i].vertex - Pc);
-            v *= factor;
-            vertices[i].vertex = (v + Pc);
-        }
-
+        scaleFactor *= factor;
+        worldValid = false;
     }
 };
 
@@ -153,7 +435,7 @@ public:
 AppMode curMode = AppMode::INSERTION;
 std::vector<Triangle> triangles;
 Triangle* selectedTriangle = NULL;
-Vertex* selectedVertex = NULL;
+bool vertexSelected = false;
 glm::vec2 touchPos;
 float ZoomFactor = 1.0f;
 float SceneOffsetX = 0.0f;
@@ -171,6 +453,7 @@ bool DrawingsInProgress = false;
 bool TranslationInProgress = false;
 int AnimationInProgress = 0;
 glm::vec3 SelectedColor(1.0f, 1.0f, 0.0f);
+static const float SELECTED_OUTLINE_WIDTH = 3.0f;
 
 std::vector<glm::vec3> COLOURS = {
     glm::vec3(1.0f, 0.5f, 0.5f),
@@ -185,25 +468,1041 @@ std::vector<glm::vec3> COLOURS = {
     glm::vec3(0.2f, 0.2f, 0.2f)
 };
 
+// Triangle and index of the selected vertex
+size_t selectedVertexTriangle = 0;
+size_t selectedVertexIndex = 0;
+
+// Find the index of a triangle of the scene, false if t is not in 'triangles'
+bool triangleIndex(const Triangle* t, size_t& index) {
+    if (t == NULL || triangles.empty()) return false;
+    if (t < &triangles[0] || t >= &triangles[0] + triangles.size()) return false;
+    index = t - &triangles[0];
+    return true;
+}
+
+bool isSelected(const Triangle* t) {
+    return t == selectedTriangle || t == animationStartTriangle || t == animationFinalTriangle;
+}
+
+// Cheapest variant that draws t: its fill mode, the outline only if it has one,
+// and the translucent pass only if it is not opaque
+size_t shaderVariant(const Triangle& t) {
+    size_t fill = t.fillBlend <= 0.0f ? FILL_VERTEX_COLOR : (t.fillBlend >= 1.0f ? FILL_FLAT : FILL_BLEND);
+    bool outline = t.outlineWidth > 0.0f || isSelected(&t);
+    bool translucent = t.opacity < 1.0f;
+    return (translucent ? OPAQUE_SHADER_VARIANTS : 0) + fill * 2 + (outline ? 1 : 0);
+}
+
+std::string shaderVariantDefines(size_t variant) {
+    static const char* FILL_DEFINES[FILL_MODES] = { "#define FILL_VERTEX_COLOR\n", "#define FILL_FLAT\n", "" };
+    return std::string(FILL_DEFINES[variant % OPAQUE_SHADER_VARIANTS / 2]) + (variant % 2 ? "#define OUTLINE\n" : "") +
+        (variant >= OPAQUE_SHADER_VARIANTS ? "#define TRANSLUCENT\n" : "");
+}
+
+// Write the 3 GPU vertices of a triangle, the missing vertices of an
+// incomplete triangle repeat its last one so that it covers no pixels
+void writeGpuTriangle(GpuVertex* out, const Triangle& t) {
+    for (size_t j = 0; j < 3; ++j) {
+        const Vertex& v = t[std::min(j, t.size() - 1)];
+        out[j].position = v.vertex;
+        out[j].color = v.color;
+        out[j].fill = glm::vec4(t.fillColor, t.fillBlend);
+        out[j].outline = glm::vec4(t.outlineColor, t.outlineWidth);
+        out[j].selected = isSelected(&t) ? 1.0f : 0.0f;
+        out[j].opacity = t.opacity;
+    }
+}
+
+glm::u8vec4 unorm8(glm::vec4 c) {
+    c = glm::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f;
+    return glm::u8vec4(GLubyte(c.x), GLubyte(c.y), GLubyte(c.z), GLubyte(c.w));
+}
+
+// Fixed point position of p in the bounds of a chunk, error grows to the
+// largest difference between p and its decoded position
+glm::u16vec2 quantize(glm::vec2 p, const glm::vec4& chunk, float& error) {
+    glm::vec2 origin(chunk.x, chunk.y);
+    glm::vec2 extent(chunk.z, chunk.w);
+    glm::vec2 q = glm::clamp((p - origin) / extent, 0.0f, 1.0f) * 65535.0f + 0.5f;
+    glm::u16vec2 packed(GLushort(q.x), GLushort(q.y));
+    glm::vec2 decoded = origin + glm::vec2(packed.x, packed.y) / 65535.0f * extent;
+    error = std::max(error, std::max(std::abs(decoded.x - p.x), std::abs(decoded.y - p.y)));
+    return packed;
+}
+
+// Same as writeGpuTriangle for the packed vertices of the chunk 'chunk', the fill is
+// mixed into the vertex colors as vertex_shader does it, the colors interpolate the same
+void writePackedTriangle(PackedVertex* out, glm::u8vec4& outline, const Triangle& t, const glm::vec4& chunk, float& error) {
+    GLubyte alpha = GLubyte(glm::clamp(t.opacity, 0.0f, 1.0f) * 127.0f + 0.5f) | (isSelected(&t) ? 128 : 0);
+    for (size_t j = 0; j < 3; ++j) {
+        const Vertex& v = t[std::min(j, t.size() - 1)];
+        out[j].position = quantize(v.vertex, chunk, error);
+        out[j].color = unorm8(glm::vec4(glm::mix(v.color, t.fillColor, glm::clamp(t.fillBlend, 0.0f, 1.0f)), 0.0f));
+        out[j].color.w = alpha;
+    }
+    outline = unorm8(glm::vec4(t.outlineColor, t.outlineWidth * 32.0f / 255.0f));
+}
+
+// Same as writeGpuTriangle for the software rasterizer, t has to be complete
+void writeRasterTriangle(RasterTriangle& out, const Triangle& t) {
+    for (size_t j = 0; j < 3; ++j) {
+        out.position[j] = t[j].vertex;
+        out.color[j] = t[j].color;
+    }
+    out.fill = glm::vec4(t.fillColor, t.fillBlend);
+    out.outline = isSelected(&t) ? glm::vec4(SelectedColor, SELECTED_OUTLINE_WIDTH) : glm::vec4(t.outlineColor, t.outlineWidth);
+}
+
+// Write the per-instance shape of a triangle for the instanced renderer
+void writeGpuShape(GpuShape& out, const Triangle& t) {
+    out.rest0 = t.getRest(0);
+    out.rest1 = t.getRest(1);
+    out.rest2 = t.getRest(2);
+    out.color0 = t[0].color;
+    out.color1 = t[std::min<size_t>(1, t.size() - 1)].color;
+    out.color2 = t[std::min<size_t>(2, t.size() - 1)].color;
+    out.fill = glm::vec4(t.fillColor, t.fillBlend);
+    out.outline = glm::vec4(t.outlineColor, t.outlineWidth);
+    out.selected = isSelected(&t) ? 1.0f : 0.0f;
+}
+
+void writeGpuTransform(GpuTransform& out, const Triangle& t) {
+    out.offset = t.barycenter();
+    out.angle = t.getAngle();
+    out.scale = t.getScale();
+}
+
+// Half-open range [first, last) of triangle indices
+typedef std::pair<size_t, size_t> Range;
+
+// Sort the ranges, drop removed triangles and merge overlapping or adjacent ranges
+std::vector<Range> coalesceRanges(std::vector<Range> dirty) {
+    std::sort(dirty.begin(), dirty.end());
+    std::vector<Range> ranges;
+    for (size_t i = 0; i < dirty.size(); ++i) {
+        size_t first = dirty[i].first;
+        size_t last = std::min(dirty[i].second, triangles.size());
+        if (first >= last) continue;
+
+        if (!ranges.empty() && first <= ranges.back().second) {
+            ranges.back().second = std::max(ranges.back().second, last);
+        } else {
+            ranges.push_back(std::make_pair(first, last));
+        }
+    }
+    return ranges;
+}
+
+// Keeps the GPU buffers of the active renderer in sync with 'triangles'
+// Edits only mark the touched triangles as dirty, flush() then uploads every
+// changed range once per frame instead of re-uploading the scene per triangle
+// The batched renderers only draw, and upload, the triangles in the view
+class SceneSync {
+private:
+    // Ranges waiting for upload, after edits of the vertices or colors and
+    // after edits of the transform only
+    std::vector<Range> dirty;
+    std::vector<Range> dirtyTransforms;
+
+    // Selected triangles as of the last flush
+    const Triangle* flushedSelection[3];
+
+    // Bounding boxes of the triangles in the active index, up to date with the
+    // first boundedDirty and boundedTransforms pending ranges
+    SpatialGrid grid;
+    Bvh bvh;
+    // Vertex j of triangle i is the point 3 * i + j, the missing vertices of an incomplete triangle are empty
+    Bvh vertexIndex;
+    // Edge equations of the triangles, for the point in triangle tests of the picking
+    EdgeTable edges;
+    size_t boundedDirty, boundedTransforms;
+    // Number of triangles when the cells were last fitted to them
+    size_t fittedCount;
+    // Number of flushes that changed the scene or what is drawn of it
+    size_t flushes;
+
+    // Sorted triangles overlapping the view rectangle as of the last flush
+    std::vector<unsigned> visible;
+    glm::vec2 culledLo, culledHi;
+    bool visibleValid;
+
+    // Visible triangles drawn as triangles, the others are merged into LodPoints
+    std::vector<unsigned> detailed;
+    float culledPixels;
+    size_t outlinesDropped;
+
+    // 1 for the triangles edited since their last upload by the batched renderers
+    std::vector<GLubyte> stale;
+
+    void markDirty(const Triangle* t) {
+        size_t i;
+        if (triangleIndex(t, i)) markDirty(i);
+    }
+
+public:
+    SceneSync() : boundedDirty(0), boundedTransforms(0), fittedCount(0), flushes(0), visibleValid(false), culledPixels(0.0f), outlinesDropped(0) {
+        flushedSelection[0] = flushedSelection[1] = flushedSelection[2] = NULL;
+    }
+
+    // An empty range still triggers a flush, e.g. to record a removal at the end
+    void markDirty(size_t first, size_t last) {
+        dirty.push_back(std::make_pair(first, last));
+    }
+
+    void markDirty(size_t i) { markDirty(i, i + 1); }
+
+    // Only the transform changed, the instanced renderer then uploads just a GpuTransform
+    void markTransformDirty(size_t i) {
+        dirtyTransforms.push_back(std::make_pair(i, i + 1));
+    }
+
+    bool isDirty() const { return !dirty.empty() || !dirtyTransforms.empty(); }
+
+    // Upload the pending ranges, returns the number of bytes sent to the GPU
+    // view selects the triangles drawn by the batched renderers, and their level
+    // of detail in a viewport of height pixels. The edits of the others are
+    // uploaded once they come into view at full detail
+    size_t flush(const glm::mat4& view, int height);
+
+    // Sorted indices of the triangles containing p, from the bounding boxes
+    // of the grid, so that a click only tests the triangles near it
+    void trianglesAt(glm::vec2 p, std::vector<unsigned>& out);
+
+    // Vertex closest to p within radius, ignoring the vertices of triangle 'skip',
+    // false if there is none. Fast enough to run on every mouse move
+    bool vertexNear(glm::vec2 p, float radius, size_t skip, size_t& triangle, size_t& vertex);
+
+    // The BVH, while it is the active index
+    Bvh& boundsHierarchy() { return bvh; }
+
+    // Changes whenever a flush changed the scene or what is drawn of it
+    size_t revision() const { return flushes; }
+
+    // Triangles drawn as triangles by the batched renderers, sorted
+    const std::vector<unsigned>& detailedTriangles() const { return detailed; }
+    size_t visibleCount() const { return InstancedRendering ? triangles.size() : visible.size(); }
+    size_t detailedCount() const { return InstancedRendering ? triangles.size() : detailed.size(); }
+    size_t outlinesDroppedCount() const { return InstancedRendering ? 0 : outlinesDropped; }
+
+private:
+    size_t flushVertices(const std::vector<Range>& ranges);
+    size_t streamVertices(const std::vector<Range>& ranges);
+    size_t flushInstances(const std::vector<Range>& shapes, const std::vector<Range>& transforms);
+    size_t flushPacked(const std::vector<Range>& ranges);
+    void updateBounds();
+    void queryBounds(glm::vec2 lo, glm::vec2 hi, std::vector<unsigned>& out) const;
+    bool updateVariants(const std::vector<Range>& ranges);
+    void updateBatches(float pixels);
+};
+
+size_t SceneSync::flush(const glm::mat4& view, int height) {
+    // The selection is a vertex attribute, re-upload the triangles that gained or lost it
+    const Triangle* selection[3] = { selectedTriangle, animationStartTriangle, animationFinalTriangle };
+    for (int k = 0; k < 3; ++k) {
+        if (selection[k] != flushedSelection[k]) {
+            markDirty(flushedSelection[k]);
+            markDirty(selection[k]);
+            flushedSelection[k] = selection[k];
+        }
+    }
+
+    // World rectangle seen through the view
+    glm::mat4 inverseView = glm::inverse(view);
+    glm::vec4 corner0 = inverseView * glm::vec4(-1.0f, -1.0f, 0.0f, 1.0f);
+    glm::vec4 corner1 = inverseView * glm::vec4(1.0f, 1.0f, 0.0f, 1.0f);
+    glm::vec2 lo = glm::min(glm::vec2(corner0.x, corner0.y), glm::vec2(corner1.x, corner1.y));
+    glm::vec2 hi = glm::max(glm::vec2(corner0.x, corner0.y), glm::vec2(corner1.x, corner1.y));
+
+    // Size of a world unit on screen
+    float pixels = std::abs(view[1][1]) * height * 0.5f;
+
+    // Swap in the BVH rebuilt in the background meanwhile
+    if (BvhIndex) bvh.poll();
+
+    bool edited = isDirty();
+    bool moved = !visibleValid || lo != culledLo || hi != culledHi || pixels != culledPixels;
+    if (!edited && (!moved || InstancedRendering)) return 0;
+    ++flushes;
+    StreamedBatches.clear();
+
+    updateBounds();
+    std::vector<Range> shapes = coalesceRanges(dirty);
+    std::vector<Range> transforms = coalesceRanges(dirtyTransforms);
+    dirty.clear();
+    dirtyTransforms.clear();
+    boundedDirty = boundedTransforms = 0;
+
+    std::vector<Range> edits(shapes);
+    edits.insert(edits.end(), transforms.begin(), transforms.end());
+    edits = coalesceRanges(edits);
+    size_t count = triangles.size();
+
+    if (InstancedRendering) {
+        visibleValid = false;
+        return flushInstances(shapes, transforms);
+    }
+
+    // The batched vertices have the transform baked in, both kinds of edits rewrite them
+    stale.resize(count, 1);
+    for (size_t r = 0; r < edits.size(); ++r) {
+        std::fill(stale.begin() + edits[r].first, stale.begin() + edits[r].second, 1);
+    }
+    bool variants = updateVariants(edits);
+
+    if (edited || moved) {
+        queryBounds(lo, hi, visible);
+        culledLo = lo;
+        culledHi = hi;
+        culledPixels = pixels;
+        visibleValid = true;
+    }
+    size_t bytes = 0;
+    if (edited || moved || variants) {
+        updateBatches(pixels);
+        bytes += VBO_Lod.update(LodPoints, 0, LodPoints.size());
+    }
+
+    // While an animation runs, its triangles go through the ring and stay stale in VBO
+    bool streaming = !PackedVertices && AnimationInProgress == 3 && VBO.capacity >= count * 3 * sizeof(GpuVertex);
+
+    // Upload the detailed triangles that were edited while out of view, merged, or since the last frame
+    std::vector<Range> uploads;
+    for (size_t k = 0; k < detailed.size(); ++k) {
+        size_t i = detailed[k];
+        if (!stale[i]) continue;
+        if (!streaming) stale[i] = 0;
+        if (!uploads.empty() && uploads.back().second == i) {
+            uploads.back().second++;
+        } else {
+            uploads.push_back(std::make_pair(i, i + 1));
+        }
+    }
+
+    if (PackedVertices) return bytes + flushPacked(uploads);
+    if (streaming) return bytes + streamVertices(uploads);
+    return bytes + flushVertices(uploads);
+}
+
+// The bounding boxes follow every edit as soon as it is needed, whatever the renderer
+void SceneSync::updateBounds() {
+    std::vector<Range> edits(dirty.begin() + boundedDirty, dirty.end());
+    edits.insert(edits.end(), dirtyTransforms.begin() + boundedTransforms, dirtyTransforms.end());
+    boundedDirty = dirty.size();
+    boundedTransforms = dirtyTransforms.size();
+
+    edits = coalesceRanges(edits);
+    grid.resize(triangles.size());
+    bvh.resize(triangles.size());
+    vertexIndex.resize(3 * triangles.size());
+    edges.resize(triangles.size());
+    const glm::vec2 emptyLo(std::numeric_limits<float>::max()), emptyHi(-std::numeric_limits<float>::max());
+    for (size_t r = 0; r < edits.size(); ++r) {
+        for (size_t i = edits[r].first; i < edits[r].second; ++i) {
+            const std::vector<Vertex>& vertices = triangles[i].getVertices();
+            glm::vec2 lo = vertices[0].vertex, hi = lo;
+            for (size_t j = 1; j < vertices.size(); ++j) {
+                lo = glm::min(lo, vertices[j].vertex);
+                hi = glm::max(hi, vertices[j].vertex);
+            }
+            if (BvhIndex) bvh.update(i, lo, hi); else grid.update(i, lo, hi);
+            if (triangles[i].isComplete()) {
+                edges.update(i, vertices[0].vertex, vertices[1].vertex, vertices[2].vertex);
+            } else {
+                edges.clear(i);
+            }
+
+            for (size_t j = 0; j < 3; ++j) {
+                if (j < vertices.size()) {
+                    vertexIndex.update(3 * i + j, vertices[j].vertex, vertices[j].vertex);
+                } else {
+                    vertexIndex.update(3 * i + j, emptyLo, emptyHi);
+                }
+            }
+        }
+    }
+
+    // The BVH rebuilds itself once the refits loosened it too much
+    if (BvhIndex) {
+        bvh.poll();
+        return;
+    }
+
+    // Fit the cells again once the scene doubled or halved, a click then tests a few triangles
+    size_t count = grid.size();
+    if (count >= 64 && (count > 2 * fittedCount || count < fittedCount / 2)) {
+        grid.fitCells();
+        fittedCount = count;
+    }
+}
+
+void SceneSync::queryBounds(glm::vec2 lo, glm::vec2 hi, std::vector<unsigned>& out) const {
+    if (BvhIndex) bvh.query(lo, hi, out); else grid.query(lo, hi, out);
+}
+
+void SceneSync::trianglesAt(glm::vec2 p, std::vector<unsigned>& out) {
+    updateBounds();
+    queryBounds(p, p, out);
+
+    // Keep the triangles that really contain p, 4 at a time
+    edges.filter(p, out);
+}
+
+bool SceneSync::vertexNear(glm::vec2 p, float radius, size_t skip, size_t& triangle, size_t& vertex) {
+    updateBounds();
+    // Only the vertex queries need the tree, it is built on the first one
+    vertexIndex.poll();
+
+    auto distance = [&](unsigned item) {
+        return item / 3 == skip ? std::numeric_limits<float>::max() : glm::distance(p, vertexIndex.lower(item));
+    };
+    unsigned id;
+    float best;
+    if (!vertexIndex.nearest(p, radius, distance, id, best)) return false;
+    triangle = id / 3;
+    vertex = id % 3;
+    return true;
+}
+
+// Returns true if the variant of a triangle changed
+bool SceneSync::updateVariants(const std::vector<Range>& ranges) {
+    size_t count = triangles.size();
+    bool changed = TriangleVariants.size() != count;
+    TriangleVariants.resize(count);
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        for (size_t i = ranges[r].first; i < ranges[r].second; ++i) {
+            GLubyte variant = shaderVariant(triangles[i]);
+            changed |= (variant != TriangleVariants[i]);
+            TriangleVariants[i] = variant;
+        }
+    }
+    return changed;
+}
+
+// Pick the level of detail of the visible triangles for a world unit of 'pixels' pixels,
+// then split the detailed ones into runs of consecutive triangles of the same variant
+void SceneSync::updateBatches(float pixels) {
+    // Cells of the merged triangles, aligned in world coordinates so that they stay put while panning
+    float cell = LOD_CELL_PIXELS / std::max(pixels, 1e-6f);
+    std::unordered_map<uint64_t, size_t> cells;
+    std::vector<float> cellArea;
+    LodPoints.clear();
+    detailed.clear();
+    outlinesDropped = 0;
+
+    std::vector<GLubyte> variants(visible.size());
+    for (size_t k = 0; k < visible.size(); ++k) {
+        size_t i = visible[k];
+        const Triangle& t = triangles[i];
+        glm::vec2 extent = BvhIndex ? bvh.upper(i) - bvh.lower(i) : grid.upper(i) - grid.lower(i);
+        extent *= pixels;
+        float size = std::max(extent.x, extent.y);
+        variants[k] = TriangleVariants[i];
+
+        // The selection and the triangle being inserted always keep their full detail
+        if (isSelected(&t) || !t.isComplete()) {
+            detailed.push_back(i);
+            continue;
+        }
+
+        if (size < LOD_POINT_PIXELS) {
+            glm::vec2 p0 = t[0].vertex, p1 = t[1].vertex, p2 = t[2].vertex;
+            float area = 0.5f * std::abs((p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x));
+            glm::vec3 color = glm::mix((t[0].color + t[1].color + t[2].color) / 3.0f, t.fillColor, t.fillBlend);
+
+            glm::vec2 center = (p0 + p1 + p2) / 3.0f;
+            int x = int(std::floor(center.x / cell)), y = int(std::floor(center.y / cell));
+            uint64_t key = (uint64_t(uint32_t(x)) << 32) | uint32_t(y);
+            auto found = cells.insert(std::make_pair(key, LodPoints.size()));
+            if (found.second) {
+                LodPoint point;
+                point.position = (glm::vec2(x, y) + 0.5f) * cell;
+                point.color = glm::vec4(0.0f);
+                LodPoints.push_back(point);
+                cellArea.push_back(0.0f);
+            }
+            LodPoints[found.first->second].color += glm::vec4(color * area, area * t.opacity);
+            LodPoints[found.first->second].triangle = GLfloat(i);
+            cellArea[found.first->second] += area;
+            continue;
+        }
+
+        // Moves the triangle to another batch, its depth keeps it in place among the others
+        if (size < LOD_OUTLINE_PIXELS && (variants[k] & 1)) {
+            variants[k] &= ~1;
+            outlinesDropped++;
+        }
+        detailed.push_back(i);
+    }
+
+    for (size_t c = 0; c < LodPoints.size(); ++c) {
+        glm::vec4& color = LodPoints[c].color;
+        float area = std::max(cellArea[c], 1e-30f);
+        color = glm::vec4(glm::vec3(color) / area, std::min(1.0f, color.w / (cell * cell)));
+    }
+
+    // variants[k] is the variant of visible[k], walk both lists together
+    for (size_t v = 0; v < SHADER_VARIANTS; ++v) {
+        VariantBatches[v].first.clear();
+        VariantBatches[v].count.clear();
+    }
+    for (size_t k = 0, d = 0; d < detailed.size(); ) {
+        while (visible[k] != detailed[d]) ++k;
+        size_t i = detailed[d];
+        GLubyte variant = variants[k];
+        size_t n = 1;
+        while (d + n < detailed.size() && detailed[d + n] == i + n && variants[k + n] == variant) ++n;
+        VariantBatch& batch = VariantBatches[variant];
+        batch.first.push_back(i * 3);
+        batch.count.push_back(n * 3);
+        k += n;
+        d += n;
+    }
+}
+
+size_t SceneSync::flushVertices(const std::vector<Range>& ranges) {
+    size_t count = triangles.size() * 3;
+    V.resize(count);
+
+    size_t bytes = 0;
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        for (size_t i = ranges[r].first; i < ranges[r].second; ++i) {
+            writeGpuTriangle(&V[i * 3], triangles[i]);
+        }
+
+        size_t first = ranges[r].first * 3;
+        size_t n = (ranges[r].second - ranges[r].first) * 3;
+        bytes += VBO.update(V, first, n);
+    }
+
+    // Record the new element count even when nothing is left to upload
+    VBO.update(V, 0, 0);
+
+    // Give the storage back once most of the scene has been removed
+    if (VBO.capacity > 4 * count * sizeof(GpuVertex)) {
+        VBO.shrink();
+    }
+    return bytes;
+}
+
+// Write the ranges straight into the next region of the ring, and draw them from
+// there instead of VBO, so that the upload never waits for the draws still reading VBO
+size_t SceneSync::streamVertices(const std::vector<Range>& ranges) {
+    size_t total = 0;
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        total += ranges[r].second - ranges[r].first;
+    }
+    if (total == 0) return 0;
+
+    // Position in the region of the first triangle of each range
+    std::vector<size_t> starts(ranges.size());
+    VBO_Stream.reserve(total * 3 * sizeof(GpuVertex));
+    GpuVertex* P = VBO_Stream.map<GpuVertex>();
+    size_t written = 0;
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        starts[r] = written;
+        for (size_t i = ranges[r].first; i < ranges[r].second; ++i) {
+            writeGpuTriangle(P + written * 3, triangles[i]);
+            written++;
+        }
+    }
+    StreamedOffset = VBO_Stream.unmap();
+    StreamedRegionWritten = true;
+
+    // Cut the streamed triangles out of the runs of each variant, the ranges are sorted
+    for (size_t v = 0; v < SHADER_VARIANTS; ++v) {
+        VariantBatch& batch = VariantBatches[v];
+        VariantBatch kept;
+        for (size_t k = 0; k < batch.first.size(); ++k) {
+            size_t first = batch.first[k] / 3;
+            size_t last = first + batch.count[k] / 3;
+            for (size_t r = 0; r < ranges.size() && first < last; ++r) {
+                size_t a = std::max(first, ranges[r].first);
+                size_t b = std::min(last, ranges[r].second);
+                if (a >= b) continue;
+                if (first < a) {
+                    kept.first.push_back(first * 3);
+                    kept.count.push_back((a - first) * 3);
+                }
+                StreamedBatch streamed = { v, GLint((starts[r] + a - ranges[r].first) * 3), GLsizei((b - a) * 3), GLint(a) };
+                StreamedBatches.push_back(streamed);
+                first = b;
+            }
+            if (first < last) {
+                kept.first.push_back(first * 3);
+                kept.count.push_back((last - first) * 3);
+            }
+        }
+        batch.first.swap(kept.first);
+        batch.count.swap(kept.count);
+    }
+    return total * 3 * sizeof(GpuVertex);
+}
+
+size_t SceneSync::flushInstances(const std::vector<Range>& shapes, const std::vector<Range>& transforms) {
+    size_t count = triangles.size();
+    Shapes.resize(count);
+    Transforms.resize(count);
+
+    size_t bytes = 0;
+    for (size_t r = 0; r < shapes.size(); ++r) {
+        for (size_t i = shapes[r].first; i < shapes[r].second; ++i) {
+            writeGpuShape(Shapes[i], triangles[i]);
+            writeGpuTransform(Transforms[i], triangles[i]);
+        }
+
+        size_t n = shapes[r].second - shapes[r].first;
+        bytes += VBO_Shapes.update(Shapes, shapes[r].first, n);
+        bytes += VBO_Transforms.update(Transforms, shapes[r].first, n);
+    }
+
+    for (size_t r = 0; r < transforms.size(); ++r) {
+        for (size_t i = transforms[r].first; i < transforms[r].second; ++i) {
+            writeGpuTransform(Transforms[i], triangles[i]);
+        }
+
+        size_t n = transforms[r].second - transforms[r].first;
+        bytes += VBO_Transforms.update(Transforms, transforms[r].first, n);
+    }
+
+    // Record the new instance count even when nothing is left to upload
+    VBO_Shapes.update(Shapes, 0, 0);
+    VBO_Transforms.update(Transforms, 0, 0);
+
+    // Give the storage back once most of the scene has been removed
+    if (VBO_Shapes.capacity > 4 * count * sizeof(GpuShape)) {
+        VBO_Shapes.shrink();
+        VBO_Transforms.shrink();
+    }
+    return bytes;
+}
+
+size_t SceneSync::flushPacked(const std::vector<Range>& ranges) {
+    size_t count = triangles.size();
+    size_t chunks = (count + CHUNK_TRIANGLES - 1) / CHUNK_TRIANGLES;
+    size_t knownChunks = std::min(PackedChunks.size(), chunks);
+    PackedV.resize(count * 3);
+    PackedOutlines.resize(count);
+    PackedChunks.resize(chunks);
+    PackedError.resize(chunks);
+
+    // A chunk is requantized when it is new or one of its triangles left its bounds
+    std::vector<bool> rebuild(chunks, false);
+    for (size_t c = knownChunks; c < chunks; ++c) rebuild[c] = true;
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        for (size_t i = ranges[r].first; i < ranges[r].second; ++i) {
+            size_t c = i / CHUNK_TRIANGLES;
+            const glm::vec4& chunk = PackedChunks[c];
+            for (size_t j = 0; j < triangles[i].size() && !rebuild[c]; ++j) {
+                glm::vec2 p = triangles[i][j].vertex;
+                rebuild[c] = p.x < chunk.x || p.y < chunk.y || p.x > chunk.x + chunk.z || p.y > chunk.y + chunk.w;
+            }
+        }
+    }
+
+    std::vector<Range> uploads(ranges);
+    size_t firstChunk = chunks, lastChunk = 0;
+    for (size_t c = 0; c < chunks; ++c) {
+        if (!rebuild[c]) continue;
+        size_t first = c * CHUNK_TRIANGLES;
+        size_t last = std::min(first + CHUNK_TRIANGLES, count);
+
+        glm::vec2 lo = triangles[first][0].vertex, hi = lo;
+        for (size_t i = first; i < last; ++i) {
+            for (size_t j = 0; j < triangles[i].size(); ++j) {
+                lo = glm::min(lo, triangles[i][j].vertex);
+                hi = glm::max(hi, triangles[i][j].vertex);
+            }
+        }
+        // Leave some room around the triangles, so that small moves keep the chunk as is
+        glm::vec2 margin = glm::max((hi - lo) * 0.125f, glm::vec2(1e-3f));
+        PackedChunks[c] = glm::vec4(lo - margin, hi - lo + 2.0f * margin);
+        PackedError[c] = 0.0f;
+
+        uploads.push_back(std::make_pair(first, last));
+        firstChunk = std::min(firstChunk, c);
+        lastChunk = c + 1;
+    }
+    uploads = coalesceRanges(uploads);
+
+    size_t bytes = 0;
+    for (size_t r = 0; r < uploads.size(); ++r) {
+        for (size_t i = uploads[r].first; i < uploads[r].second; ++i) {
+            size_t c = i / CHUNK_TRIANGLES;
+            writePackedTriangle(&PackedV[i * 3], PackedOutlines[i], triangles[i], PackedChunks[c], PackedError[c]);
+        }
+
+        size_t first = uploads[r].first;
+        size_t n = uploads[r].second - uploads[r].first;
+        bytes += VBO_Packed.update(PackedV, first * 3, n * 3);
+        bytes += VBO_Outlines.update(PackedOutlines, first, n);
+    }
+    if (firstChunk < lastChunk) {
+        bytes += VBO_Chunks.update(PackedChunks, firstChunk, lastChunk - firstChunk);
+    }
+
+    // Record the new element counts even when nothing is left to upload
+    VBO_Packed.update(PackedV, 0, 0);
+    VBO_Outlines.update(PackedOutlines, 0, 0);
+    VBO_Chunks.update(PackedChunks, 0, 0);
+
+    // Give the storage back once most of the scene has been removed
+    if (VBO_Packed.capacity > 4 * count * 3 * sizeof(PackedVertex)) {
+        VBO_Packed.shrink();
+        VBO_Outlines.shrink();
+        VBO_Chunks.shrink();
+    }
+    return bytes;
+}
+
+// Largest quantization error of the packed vertices, measured and guaranteed, in world units
+void packedPrecision(float& measured, float& bound) {
+    measured = bound = 0.0f;
+    for (size_t c = 0; c < PackedChunks.size(); ++c) {
+        measured = std::max(measured, PackedError[c]);
+        bound = std::max(bound, std::max(PackedChunks[c].z, PackedChunks[c].w) / 65535.0f * 0.5f);
+    }
+}
+
+SceneSync sceneSync;
+
+// Queue a triangle of the scene for the next GPU sync
+void markTriangleDirty(const Triangle* t) {
+    size_t i;
+    if (triangleIndex(t, i)) sceneSync.markDirty(i);
+}
+
+// Queue a triangle whose transform alone changed for the next GPU sync
+void markTransformDirty(const Triangle* t) {
+    size_t i;
+    if (triangleIndex(t, i)) sceneSync.markTransformDirty(i);
+}
+
+// Per-frame counters, printed once per second after pressing F2
+struct FrameStats {
+    size_t frames;
+    size_t bytesUploaded;
+    size_t peakBytesUploaded;
+    size_t drawCalls;
+
+    FrameStats() : frames(0), bytesUploaded(0), peakBytesUploaded(0), drawCalls(0) { }
+};
+
+bool ShowStats = false;
+FrameStats stats;
+
+// Set by the input callbacks when the next frame may look different,
+// edits of the triangles are tracked by sceneSync instead
+bool RedrawRequested = true;
+
+// Command line options, see printUsage
+struct Options {
+    // Render frames frames into an offscreen framebuffer without window or display
+    bool headless;
+    // Render frames frames on the CPU, without any GL
+    bool software;
+    // Threads of the software rasterizer, 0 for one per core
+    unsigned threads;
+    int width;
+    int height;
+    size_t frames;
+    // Image of the last headless frame, empty for none
+    std::string dump;
+    // Size of the random scene to start with
+    size_t triangles;
+    // Number of queries of each kind run against the grid and the BVH, 0 to open the editor
+    size_t benchIndex;
+
+    Options() : headless(false), software(false), threads(0), width(WIN_WIDTH), height(WIN_HEIGHT), frames(1), triangles(0), benchIndex(0) { }
+};
+
+void printUsage(const char* program) {
+    printf("Usage: %s [options]\n"
+        "  --headless          render without a window, through EGL (built with USE_EGL)\n"
+        "  --software          render without GL, with the multithreaded software rasterizer\n"
+        "  --threads N         threads of the software rasterizer (default one per core)\n"
+        "  --size WxH          size of the headless or software framebuffer (default %dx%d)\n"
+        "  --frames N          number of headless or software frames (default 1)\n"
+        "  --dump FILE.ppm     write the last headless or software frame to an image\n"
+        "  --triangles N       start with N random triangles\n"
+        "  --bench-index N     time N point, rectangle, nearest triangle and vertex queries\n"
+        "                      and point in triangle tests\n"
+        "  --stats             print the frame statistics (same as F2)\n",
+        program, WIN_WIDTH, WIN_HEIGHT);
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--headless")) {
+            options.headless = true;
+        } else if (!strcmp(argv[i], "--software")) {
+            options.software = true;
+        } else if (!strcmp(argv[i], "--threads") && hasValue) {
+            options.threads = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--size") && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0) return false;
+        } else if (!strcmp(argv[i], "--frames") && hasValue) {
+            options.frames = std::max(1L, strtol(argv[++i], NULL, 10));
+        } else if (!strcmp(argv[i], "--dump") && hasValue) {
+            options.dump = argv[++i];
+        } else if (!strcmp(argv[i], "--triangles") && hasValue) {
+            options.triangles = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--bench-index") && hasValue) {
+            options.benchIndex = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--stats")) {
+            ShowStats = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// World to clip coordinates for a framebuffer of width x height pixels
+glm::mat4 sceneView(int width, int height) {
+    float aspect_ratio = float(height) / float(width); // corresponds to the necessary width scaling
+    glm::mat4 view = glm::scale(glm::mat4(1.f), glm::vec3(aspect_ratio * ZoomFactor, ZoomFactor, 1.0f));
+    return glm::translate(view, glm::vec3(SceneOffsetX, SceneOffsetY, 0.0f));
+}
+
+// Render the scene on the CPU and report the throughput, for machines without any GL stack
+// The edge of a triangle being inserted is not drawn
+int renderSoftware(const Options& options) {
+    std::vector<RasterTriangle> scene;
+    scene.reserve(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        if (!triangles[i].isComplete()) continue;
+        scene.push_back(RasterTriangle());
+        writeRasterTriangle(scene.back(), triangles[i]);
+    }
+
+    SoftwareRasterizer rasterizer(options.width, options.height, options.threads);
+    glm::mat4 view = sceneView(options.width, options.height);
+    double seconds = 0;
+    size_t pixels = 0;
+    for (size_t frame = 0; frame < options.frames; ++frame) {
+        rasterizer.render(scene, view, glm::vec3(0.5f, 0.5f, 0.5f));
+        seconds += rasterizer.stats.seconds;
+        pixels += rasterizer.stats.pixels;
+    }
+
+    printf("Software: %zu frames of %dx%d with %zu triangles on %u threads in %.3f s (%.3f ms/frame)\n",
+        options.frames, options.width, options.height, scene.size(), rasterizer.threads(), seconds, seconds * 1000.0 / options.frames);
+    printf("Software: %.2f M triangles/s, %.2f M pixels/s\n",
+        scene.size() * options.frames / seconds * 1e-6, pixels / seconds * 1e-6);
+
+    if (!options.dump.empty() && !write_ppm(options.dump, options.width, options.height, rasterizer.pixels())) {
+        fprintf(stderr, "Error: could not write %s\n", options.dump.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// Distance from p to the closest point of t, 0 inside
+float distanceToTriangle(const Triangle& t, glm::vec2 p) {
+    if (t.isInside(p)) return 0.0f;
+    float best = std::numeric_limits<float>::max();
+    for (size_t j = 0; j < t.size(); ++j) {
+        glm::vec2 a = t[j].vertex, b = t[(j + 1) % t.size()].vertex;
+        glm::vec2 ab = b - a;
+        float along = glm::dot(ab, ab) > 0.0f ? glm::clamp(glm::dot(p - a, ab) / glm::dot(ab, ab), 0.0f, 1.0f) : 0.0f;
+        best = std::min(best, glm::length(a + ab * along - p));
+    }
+    return best;
+}
+
+// Time the point, rectangle and nearest triangle queries of the uniform grid and
+// the BVH over the scene, the nearest vertex queries, with the nodes visited per query,
+// and the point in triangle test over the whole scene
+int benchmarkIndex(const Options& options) {
+    SpatialGrid grid;
+    Bvh bvh;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        const std::vector<Vertex>& vertices = triangles[i].getVertices();
+        glm::vec2 lo = vertices[0].vertex, hi = lo;
+        for (size_t j = 1; j < vertices.size(); ++j) {
+            lo = glm::min(lo, vertices[j].vertex);
+            hi = glm::max(hi, vertices[j].vertex);
+        }
+        grid.update(i, lo, hi);
+        bvh.update(i, lo, hi);
+    }
+    grid.fitCells();
+    bvh.rebuild();
+
+    std::mt19937 random(2);
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+    std::vector<glm::vec2> points(options.benchIndex);
+    for (size_t q = 0; q < points.size(); ++q) points[q] = glm::vec2(position(random), position(random));
+
+    typedef std::chrono::high_resolution_clock Clock;
+    std::vector<unsigned> out;
+    size_t found = 0;
+    auto us = [&](Clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::duration<double, std::micro> >(Clock::now() - start).count() / std::max<size_t>(1, points.size());
+    };
+    auto report = [&](const char* query, const char* index, double time, const Bvh::Stats* stats) {
+        printf("%-9s %-6s %8.2f us/query, %.1f results", query, index, time, double(found) / std::max<size_t>(1, points.size()));
+        if (stats) printf(", %.1f nodes visited, %.1f boxes tested",
+            double(stats->nodesVisited) / stats->queries, double(stats->itemsTested) / stats->queries);
+        printf("\n");
+        found = 0;
+    };
+    printf("Index benchmark: %zu triangles, grid cells of %.4f, %zu BVH nodes\n", triangles.size(), grid.cell(), bvh.nodes());
+
+    Clock::time_point start = Clock::now();
+    for (size_t q = 0; q < points.size(); ++q) { grid.query(points[q], points[q], out); found += out.size(); }
+    report("point", "grid", us(start), NULL);
+    bvh.stats = Bvh::Stats();
+    start = Clock::now();
+    for (size_t q = 0; q < points.size(); ++q) { bvh.query(points[q], points[q], out); found += out.size(); }
+    report("point", "BVH", us(start), &bvh.stats);
+
+    glm::vec2 extent(0.1f);
+    start = Clock::now();
+    for (size_t q = 0; q < points.size(); ++q) { grid.query(points[q], points[q] + extent, out); found += out.size(); }
+    report("rectangle", "grid", us(start), NULL);
+    bvh.stats = Bvh::Stats();
+    start = Clock::now();
+    for (size_t q = 0; q < points.size(); ++q) { bvh.query(points[q], points[q] + extent, out); found += out.size(); }
+    report("rectangle", "BVH", us(start), &bvh.stats);
+
+    // The grid has no nearest query, compare with a scan of every triangle
+    size_t scanned = std::min<size_t>(points.size(), 100);
+    start = Clock::now();
+    for (size_t q = 0; q < scanned; ++q) {
+        float best = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < triangles.size(); ++i) best = std::min(best, distanceToTriangle(triangles[i], points[q]));
+        found += best < std::numeric_limits<float>::max();
+    }
+    double scanTime = us(start) * points.size() / std::max<size_t>(1, scanned);
+    found = found * points.size() / std::max<size_t>(1, scanned);
+    report("nearest", "scan", scanTime, NULL);
+    bvh.stats = Bvh::Stats();
+    start = Clock::now();
+    for (size_t q = 0; q < points.size(); ++q) {
+        unsigned id;
+        float best;
+        found += bvh.nearest(points[q], std::numeric_limits<float>::max(), [&](unsigned i) { return distanceToTriangle(triangles[i], points[q]); }, id, best);
+    }
+    report("nearest", "BVH", us(start), &bvh.stats);
+
+    // Vertex within VERTEX_PICK_RADIUS, as in the color mode, by a scan of every vertex and by the point index
+    Bvh vertices;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        for (size_t j = 0; j < triangles[i].size(); ++j) vertices.update(3 * i + j, triangles[i][j].vertex, triangles[i][j].vertex);
+    }
+    vertices.rebuild();
+    start = Clock::now();
+    for (size_t q = 0; q < scanned; ++q) {
+        float best = VERTEX_PICK_RADIUS;
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            for (size_t j = 0; j < triangles[i].size(); ++j) best = std::min(best, glm::distance(points[q], triangles[i][j].vertex));
+        }
+        found += best < VERTEX_PICK_RADIUS;
+    }
+    scanTime = us(start) * points.size() / std::max<size_t>(1, scanned);
+    found = found * points.size() / std::max<size_t>(1, scanned);
+    report("vertex", "scan", scanTime, NULL);
+    vertices.stats = Bvh::Stats();
+    start = Clock::now();
+    for (size_t q = 0; q < points.size(); ++q) {
+        unsigned id;
+        float best;
+        found += vertices.nearest(points[q], VERTEX_PICK_RADIUS, [&](unsigned i) { return glm::distance(points[q], vertices.lower(i)); }, id, best);
+    }
+    report("vertex", "BVH", us(start), &vertices.stats);
+
+    // Point in triangle over every triangle, one at a time from the vertices with the sign
+    // of the cross products, and 4 at a time from the edge table
+    EdgeTable edges;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        if (triangles[i].isComplete()) edges.update(i, triangles[i][0].vertex, triangles[i][1].vertex, triangles[i][2].vertex);
+    }
+    start = Clock::now();
+    for (size_t q = 0; q < scanned; ++q) {
+        for (size_t i = 0; i < triangles.size(); ++i) found += triangles[i].isInside(points[q]);
+    }
+    scanTime = us(start) * points.size() / std::max<size_t>(1, scanned);
+    found = found * points.size() / std::max<size_t>(1, scanned);
+    report("inside", "scan", scanTime, NULL);
+    start = Clock::now();
+    for (size_t q = 0; q < scanned; ++q) {
+        edges.containing(points[q], 0, triangles.size(), out);
+        found += out.size();
+        out.clear();
+    }
+    scanTime = us(start) * points.size() / std::max<size_t>(1, scanned);
+    found = found * points.size() / std::max<size_t>(1, scanned);
+    report("inside", "edges", scanTime, NULL);
+    return 0;
+}
+
+// Fill the scene with count random triangles, the same ones on every run
+void generateScene(size_t count) {
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> position(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> size(-0.05f, 0.05f);
+    std::uniform_int_distribution<int> colour(0, 8);
+
+    triangles.reserve(triangles.size() + count);
+    for (size_t i = 0; i < count; ++i) {
+        glm::vec2 center(position(random), position(random));
+        triangles.push_back(Triangle());
+        for (int j = 0; j < 3; ++j) {
+            triangles.back().addVertex(center + glm::vec2(size(random), size(random)), COLOURS[colour(random)]);
+        }
+    }
+    sceneSync.markDirty(0, triangles.size());
+}
+
 
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     glViewport(0, 0, width, height);
+    RedrawRequested = true;
+}
+
+void window_refresh_callback(GLFWwindow* window)
+{
+    RedrawRequested = true;
+}
+
+
+// Move p onto the closest vertex of the other triangles within 'radius', so that
+// the new triangles can share their vertices. Holding shift places p freely
+glm::vec2 snapToVertex(GLFWwindow* window, glm::vec2 p, float radius) {
+    if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS || glfwGetKey(window, GLFW_KEY_RIGHT_SHIFT) == GLFW_PRESS) return p;
+
+    size_t skip = DrawingsInProgress ? triangles.size() - 1 : size_t(-1);
+    size_t triangle, vertex;
+    if (!sceneSync.vertexNear(p, radius, skip, triangle, vertex)) return p;
+    return triangles[triangle][vertex].vertex;
 }
 
+// Radius of the vertex snapping in world units, the view maps one world unit
+// to ZoomFactor * height / 2 pixels
+float snapRadius(GLFWwindow* window) {
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    return VERTEX_SNAP_PIXELS / (ZoomFactor * std::max(height, 1) * 0.5f);
+}
 
-void handleInsertionMove(double xworld, double yworld) {
+void handleInsertionMove(GLFWwindow* window, double xworld, double yworld) {
 
     if (DrawingsInProgress) {
         // Update last added point
-        triangles.back()[triangles.back().size() - 1].vertex = glm::vec2(xworld, yworld);
+        glm::vec2 p = snapToVertex(window, glm::vec2(xworld, yworld), snapRadius(window));
+        triangles.back().setVertex(triangles.back().size() - 1, p);
+        markTriangleDirty(&triangles.back());
     }
 }
 
-void handleInsertionClick(double xworld, double yworld) {
+void handleInsertionClick(GLFWwindow* window, double xworld, double yworld) {
 
     printf("Mouse down\n");
+    glm::vec2 p = snapToVertex(window, glm::vec2(xworld, yworld), snapRadius(window));
 
     if (DrawingsInProgress) {
         // Finish triangle
@@ -211,7 +1510,8 @@ void handleInsertionClick(double xworld, double yworld) {
             DrawingsInProgress = false;
         }
         else {
-            triangles.back().addVertex(glm::vec2(xworld, yworld));
+            triangles.back().addVertex(p);
+            markTriangleDirty(&triangles.back());
         }
 
         return;
@@ -219,14 +1519,47 @@ void handleInsertionClick(double xworld, double yworld) {
 
     triangles.push_back(Triangle());
     // One real point
-    triangles.back().addVertex(glm::vec2(xworld, yworld));
+    triangles.back().addVertex(p);
     // Second fake point for 'mouse move' event
-    triangles.back().addVertex(glm::vec2(xworld, yworld));
+    triangles.back().addVertex(p);
+    markTriangleDirty(&triangles.back());
 
     DrawingsInProgress = true;
 }
 
 
+// Pixel of the ID buffer under the world position p, false outside of it
+bool idBufferPixel(glm::vec2 p, int& x, int& y) {
+    glm::vec4 clip = IdBufferView * glm::vec4(p, 0.0f, 1.0f);
+    x = int(std::floor((clip.x + 1.0f) * 0.5f * IdBuffer.width));
+    y = int(std::floor((clip.y + 1.0f) * 0.5f * IdBuffer.height));
+    return x >= 0 && y >= 0 && x < IdBuffer.width && y < IdBuffer.height;
+}
+
+// Queue the readback of the ID buffer under p, a click there then finds it done
+void requestPick(glm::vec2 p) {
+    int x, y;
+    if (!GpuPicking || !IdBufferValid || !idBufferPixel(p, x, y) || IdReadback.has(x, y)) return;
+    IdReadback.read(IdBuffer.id, GL_COLOR_ATTACHMENT0, x, y);
+}
+
+// Triangles under p: with GPU picking the one drawn on top there in the last frame,
+// otherwise the ones containing p, sorted. Edits since the last frame, e.g. a removal
+// shifting the indices, leave the ID buffer out of date until the next one
+void pickTriangles(glm::vec2 p, std::vector<unsigned>& picked) {
+    if (!GpuPicking || !IdBufferValid || InstancedRendering || sceneSync.isDirty()) {
+        sceneSync.trianglesAt(p, picked);
+        return;
+    }
+
+    picked.clear();
+    int x, y;
+    if (!idBufferPixel(p, x, y)) return;
+    if (!IdReadback.has(x, y)) IdReadback.read(IdBuffer.id, GL_COLOR_ATTACHMENT0, x, y);
+    GLuint id = IdReadback.value();
+    if (id > 0 && id <= triangles.size()) picked.push_back(id - 1);
+}
+
 void handleSelectionMove(double xworld, double yworld) {
     if (TranslationInProgress == false || selectedTriangle == NULL) return;
 
@@ -240,6 +1573,7 @@ void handleSelectionMove(double xworld, double yworld) {
     printf("Delta=(%lf, %lf)\n", delta.x, delta.y);
 
     selectedTriangle->move(delta);
+    markTransformDirty(selectedTriangle);
 }
 
 void handleTranslationClick(double xworld, double yworld) {
@@ -255,10 +1589,11 @@ void handleTranslationClick(double xworld, double yworld) {
     touchPos = glm::vec2(xworld, yworld);
     selectedTriangle = NULL;
 
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        if (triangles[i].isInside(touchPos)) {
-            selectedTriangle = &triangles[i];
-        }
+    // The last one drawn is on top
+    std::vector<unsigned> picked;
+    pickTriangles(touchPos, picked);
+    if (!picked.empty()) {
+        selectedTriangle = &triangles[picked.back()];
     }
 
 
@@ -266,11 +1601,13 @@ void handleTranslationClick(double xworld, double yworld) {
 }
 
 void handleRemoveClick(double xworld, double yworld) {
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        if (triangles[i].isInside(glm::vec2(xworld, yworld))) {
-            triangles.erase(triangles.begin() + i);
-            return;
-        }
+    std::vector<unsigned> picked;
+    pickTriangles(glm::vec2(xworld, yworld), picked);
+    if (!picked.empty()) {
+        size_t i = picked.front();
+        triangles.erase(triangles.begin() + i);
+        // Every following triangle shifted down by one slot
+        sceneSync.markDirty(i, triangles.size());
     }
 }
 
@@ -292,6 +1629,9 @@ void mouse_pos_callback(GLFWwindow* window, double xpos, double ypos) {
     xworld = p_world.x;
     yworld = p_world.y;
 
+    // Read the ID buffer under the cursor ahead of a click
+    requestPick(glm::vec2(xworld, yworld));
+
     switch (curMode)
     {
     case NONE:
@@ -299,7 +1639,7 @@ void mouse_pos_callback(GLFWwindow* window, double xpos, double ypos) {
     case INSERTION:
     {
         if (DrawingsInProgress)
-            handleInsertionMove(xworld, yworld);
+            handleInsertionMove(window, xworld, yworld);
     }
     break;
     case TRANSFORMATION:
@@ -311,48 +1651,37 @@ void mouse_pos_callback(GLFWwindow* window, double xpos, double ypos) {
     default:
         break;
     }
-
-    // Upload the change to the GPU
-    VBO.update(V);
 }
 
 void handleSelectClosestVertex(double xworld, double yworld) {
     printf("Select closest\n");
-    const double RADIUS = 0.1;
-    double minLen = -1;
     glm::vec2 p(xworld, yworld);
 
-    selectedVertex = NULL;
-    int triagPos = -1;
-    int vertexPos = -1;
-
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        for (size_t j = 0; j < 3; ++j) {
-            double dist = glm::distance(p, triangles[i][j].vertex);
-            printf("dist=%lf (%d)\n", dist, dist <= RADIUS);
-            if (dist <= RADIUS && (minLen == -1 || dist < minLen)) {
-                minLen = dist;
-                triagPos = i;
-                vertexPos = j;
-            }
-        }
-    }
-
-    if (triagPos != -1 && vertexPos != -1) {
-        selectedVertex = &triangles[triagPos][vertexPos];
-        printf("CLosest point: (%lf, %lf)\n", selectedVertex->vertex.x, selectedVertex->vertex.y);
+    vertexSelected = false;
+    size_t triagPos, vertexPos;
+    if (sceneSync.vertexNear(p, VERTEX_PICK_RADIUS, size_t(-1), triagPos, vertexPos)) {
+        vertexSelected = true;
+        selectedVertexTriangle = triagPos;
+        selectedVertexIndex = vertexPos;
+        glm::vec2 v = triangles[triagPos][vertexPos].vertex;
+        printf("CLosest point: (%lf, %lf)\n", v.x, v.y);
     } else {
         printf("Closest point not found\n");
     }
 }
 
+bool isAnimating() {
+    return curMode == AppMode::ANIMATION && AnimationInProgress == 3 && AnimationTimeout > 0;
+}
+
 void runAnimation() {
     if (AnimationInProgress != 3 || AnimationTimeout <= 0)  return;
 
     // Move one start triangle to final
     for (int i = 0; i < 3; ++i) {
-        (*animationStartTriangle)[i].vertex += AnimationDeltas[i];
+        animationStartTriangle->setVertex(i, (*animationStartTriangle)[i].vertex + AnimationDeltas[i]);
     }
+    markTriangleDirty(animationStartTriangle);
     AnimationTimeout -= ANIMATION_STEP;
     if (AnimationTimeout <= 0) {
         AnimationInProgress = 0;
@@ -365,31 +1694,31 @@ void handleAnimationClick(double xworld, double yworld) {
     if (AnimationInProgress >= 2) return;
     printf("Animation click, AnimationStatus=[%d]\n", AnimationInProgress);
 
+    std::vector<unsigned> picked;
+    pickTriangles(glm::vec2(xworld, yworld), picked);
+
     if (AnimationInProgress == 1) {
         animationFinalTriangle = NULL;
-        for (size_t i = 0; i < triangles.size(); ++i) {
-            if (triangles[i].isInside(glm::vec2(xworld, yworld))) {
-                animationFinalTriangle = &triangles[i];
-                printf("Final triangle found\n");
-                if (animationStartTriangle && animationFinalTriangle) {
-                    printf("prepare animation...\n");
-                    // Save prev pos
-                    restoreTriangle = *animationStartTriangle;
-                    // Find delta for each point
-                    for (int i = 0; i < 3; ++i) {
-                        glm::vec2 ds = (animationFinalTriangle->getVertices()[i].vertex - animationStartTriangle->getVertices()[i].vertex);
-                        ds /= (ANIMATION_TIME / ANIMATION_STEP);
-                        AnimationDeltas[i] = ds;
-                    }
+        if (!picked.empty()) {
+            animationFinalTriangle = &triangles[picked.front()];
+            printf("Final triangle found\n");
+            if (animationStartTriangle && animationFinalTriangle) {
+                printf("prepare animation...\n");
+                // Save prev pos
+                restoreTriangle = *animationStartTriangle;
+                // Find delta for each point
+                for (int i = 0; i < 3; ++i) {
+                    glm::vec2 ds = (animationFinalTriangle->getVertices()[i].vertex - animationStartTriangle->getVertices()[i].vertex);
+                    ds /= (ANIMATION_TIME / ANIMATION_STEP);
+                    AnimationDeltas[i] = ds;
+                }
 
-                    AnimationInProgress = 2;
-                    AnimationTimeout = (ANIMATION_TIME / ANIMATION_STEP) ;
+                AnimationInProgress = 2;
+                AnimationTimeout = (ANIMATION_TIME / ANIMATION_STEP) ;
 
-                    return;
-                }
-                printf("One of the triangles is not set, restart\n");
-                break;
+                return;
             }
+            printf("One of the triangles is not set, restart\n");
         }
 
         AnimationInProgress = 0;
@@ -398,12 +1727,10 @@ void handleAnimationClick(double xworld, double yworld) {
     }
 
     animationStartTriangle = NULL;
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        if (triangles[i].isInside(glm::vec2(xworld, yworld))) {
-            animationStartTriangle = &triangles[i];
-            AnimationInProgress = 1;
-            return;
-        }
+    if (!picked.empty()) {
+        animationStartTriangle = &triangles[picked.front()];
+        AnimationInProgress = 1;
+        return;
     }
 
     AnimationInProgress = 0;
@@ -437,7 +1764,7 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
     {
         printf("INSERTION\n");
         if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
-            handleInsertionClick(xworld, yworld);
+            handleInsertionClick(window, xworld, yworld);
         }
 
         break;
@@ -475,8 +1802,8 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
         break;
     }
 
-    // Upload the change to the GPU
-    VBO.update(V);
+    // Clicks can change the selection
+    RedrawRequested = true;
 }
 
 // Reset prev state
@@ -485,7 +1812,7 @@ void resetMode(AppMode mode) {
         // Check if triangles contains incomplete triangle. Stop drawing mode (in case if it was enable)
         if (!triangles.empty() && (triangles.back().size() % 3 != 0 || DrawingsInProgress)) {
             triangles.pop_back();
-            V.resize(triangles.size() * 3);
+            sceneSync.markDirty(triangles.size());
             DrawingsInProgress = false;
         }
         return;
@@ -506,7 +1833,7 @@ void resetMode(AppMode mode) {
     }
 
     if (mode == AppMode::COLOR_VERTEX) {
-        selectedVertex = NULL;
+        vertexSelected = false;
         return;
     }
 
@@ -574,6 +1901,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         printf("Rotate clockwise\n");
         // Clockwise rotation
         selectedTriangle->rotate(10.0f);
+        markTransformDirty(selectedTriangle);
         break;
     }
 
@@ -583,6 +1911,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         printf("Rotate counter clockwise\n");
         // Counter clockwise rotation
         selectedTriangle->rotate(-10.0f);
+        markTransformDirty(selectedTriangle);
         break;
     }
     case GLFW_KEY_K:
@@ -591,6 +1920,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         printf("Scale up for 20%\n");
         // Scale up
         selectedTriangle->scale(1.25);
+        markTransformDirty(selectedTriangle);
         break;
     }
     case GLFW_KEY_L:
@@ -599,6 +1929,7 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         printf("Scale down for 20%\n");
         // Scale down
         selectedTriangle->scale(0.75);
+        markTransformDirty(selectedTriangle);
         break;
     }
     case GLFW_KEY_C:
@@ -612,65 +1943,120 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
     // Color vertex
     case GLFW_KEY_1:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 1\n");
-        selectedVertex->color = COLOURS[0];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[0]);
+        sceneSync.markDirty(selectedVertexTriangle);
         break;
     }
     case GLFW_KEY_2:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 2\n");
-        selectedVertex->color = COLOURS[1];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[1]);
+        sceneSync.markDirty(selectedVertexTriangle);
         break;
     }
     case GLFW_KEY_3:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 3\n");
-        selectedVertex->color = COLOURS[2];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[2]);
+        sceneSync.markDirty(selectedVertexTriangle);
         break;
     }
     case GLFW_KEY_4:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 4\n");
-        selectedVertex->color = COLOURS[3];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[3]);
+        sceneSync.markDirty(selectedVertexTriangle);
         break;
     }
     case GLFW_KEY_5:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 5\n");
-        selectedVertex->color = COLOURS[4];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[4]);
+        sceneSync.markDirty(selectedVertexTriangle);
         break;
     }
     case GLFW_KEY_6:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 6\n");
-        selectedVertex->color = COLOURS[5];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[5]);
+        sceneSync.markDirty(selectedVertexTriangle);
         break;
     }
     case GLFW_KEY_7:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 7\n");
-        selectedVertex->color = COLOURS[6];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[6]);
+        sceneSync.markDirty(selectedVertexTriangle);
         break;
     }
     case GLFW_KEY_8:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 8\n");
-        selectedVertex->color = COLOURS[7];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[7]);
+        sceneSync.markDirty(selectedVertexTriangle);
         break;
     }
     case GLFW_KEY_9:
     {
-        if (curMode != AppMode::COLOR_VERTEX || selectedVertex == NULL) return;
+        if (curMode != AppMode::COLOR_VERTEX || !vertexSelected) return;
         printf("SET COLOR 9\n");
-        selectedVertex->color = COLOURS[8];
+        triangles[selectedVertexTriangle].setColor(selectedVertexIndex, COLOURS[8]);
+        sceneSync.markDirty(selectedVertexTriangle);
+        break;
+    }
+    case GLFW_KEY_F2:
+    {
+        ShowStats = !ShowStats;
+        printf("Frame statistics %s\n", ShowStats ? "on" : "off");
+        break;
+    }
+    case GLFW_KEY_F3:
+    {
+        InstancedRendering = !InstancedRendering;
+        printf("%s renderer\n", InstancedRendering ? "Instanced" : "Batched");
+        // The buffers of the other renderer were not kept up to date
+        sceneSync.markDirty(0, triangles.size());
+        break;
+    }
+    case GLFW_KEY_T:
+    {
+        if (curMode != AppMode::TRANSFORMATION || selectedTriangle == NULL) return;
+        // Cycle through 100%, 75%, 50% and 25% opacity
+        selectedTriangle->opacity = selectedTriangle->opacity > 0.3f ? selectedTriangle->opacity - 0.25f : 1.0f;
+        printf("Opacity %d%%\n", int(selectedTriangle->opacity * 100.0f + 0.5f));
+        markTriangleDirty(selectedTriangle);
+        break;
+    }
+    case GLFW_KEY_F5:
+    {
+        BvhIndex = !BvhIndex;
+        printf("%s index\n", BvhIndex ? "BVH" : "Grid");
+        // The index now active gets every bounding box
+        sceneSync.markDirty(0, triangles.size());
+        break;
+    }
+    case GLFW_KEY_F6:
+    {
+        GpuPicking = !GpuPicking;
+        printf("%s picking\n", GpuPicking ? "GPU" : "CPU");
+        // Drawn again at the next frame
+        IdBufferValid = false;
+        break;
+    }
+    case GLFW_KEY_F4:
+    {
+        PackedVertices = !PackedVertices;
+        printf("%s vertices\n", PackedVertices ? "Packed" : "Float");
+        sceneSync.markDirty(0, triangles.size());
         break;
     }
     case GLFW_KEY_W:
@@ -717,15 +2103,38 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
         break;
     }
 
-    // Upload the change to the GPU
-    VBO.update(V);
-    VBO_C.update(C);
+    // Keys can change the view, the mode or start an animation
+    RedrawRequested = true;
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
     GLFWwindow* window;
 
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    generateScene(options.triangles);
+    if (options.benchIndex)
+        return benchmarkIndex(options);
+    if (options.software)
+        return renderSoftware(options);
+
+    // Headless runs need no display server, the context comes from EGL, where GLEW loads its functions
+    // from too: without the null platform of GLFW 3.4 or an EGL build of GLEW they would need a display
+#if defined(GLFW_PLATFORM_NULL) && defined(GLEW_EGL)
+    if (options.headless)
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+#else
+    if (options.headless) {
+        fprintf(stderr, "Error: --headless needs GLFW 3.4 and a build with USE_EGL\n");
+        return -1;
+    }
+#endif
+
     // Initialize the library
     if (!glfwInit())
         return -1;
@@ -733,6 +2142,9 @@ int main(void)
     // Activate supersampling
     glfwWindowHint(GLFW_SAMPLES, 8);
 
+    // The batched renderers keep the scene order through the depth test
+    glfwWindowHint(GLFW_DEPTH_BITS, 24);
+
     // Ensure that we get at least a 3.2 context
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
@@ -743,8 +2155,27 @@ int main(void)
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
 
+    // GLEW built for EGL only loads its functions from EGL contexts
+#ifdef GLEW_EGL
+    glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+#endif
+
+    // Builds that check GL errors ask for debug output
+#if !defined(NDEBUG) || defined(GL_DIAGNOSTICS)
+    glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
+#endif
+
+    // Headless runs draw into an offscreen framebuffer, the hidden window only holds the context
+    // Mesa only exposes GL 3.2 as a core profile
+    if (options.headless) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_SAMPLES, 0);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    }
+
     // Create a windowed mode window and its OpenGL context
-    window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, WIN_TITLE, NULL, NULL);
+    window = options.headless ? glfwCreateWindow(1, 1, WIN_TITLE, NULL, NULL) : glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, WIN_TITLE, NULL, NULL);
     if (!window)
     {
         glfwTerminate();
@@ -766,6 +2197,9 @@ int main(void)
     fprintf(stdout, "Status: Using GLEW %s\n", glewGetString(GLEW_VERSION));
 #endif
 
+    if (enable_gl_debug_output())
+        printf("Status: Reporting GL errors through debug output\n");
+
     int major, minor, rev;
     major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
     minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
@@ -787,63 +2221,384 @@ int main(void)
     // A VBO is a data container that lives in the GPU memory
     VBO.init();
 
+    // Positions and colors are interleaved in the same VBO
     V.resize(1);
-    V[0] = glm::vec2(0, 0);
+    V[0].position = glm::vec2(0, 0);
+    V[0].color = glm::vec3(1, 0, 0);
     VBO.update(V);
 
-    // Second VBO for colors
-    VBO_C.init();
-    C.resize(1);
-    C[0] = glm::vec3(1, 0, 0);
+    // Triple-buffered ring for the streamed vertices
+    VBO_Stream.init(1024 * 3 * sizeof(GpuVertex));
 
-    VBO_C.update(C);
+    // Reuse the programs linked by the previous runs on this driver
+    Program::binary_cache_dir = "shader_cache";
 
     // Initialize the OpenGL Program
     // A program controls the OpenGL pipeline and it must contains
     // at least a vertex shader and a fragment shader to be valid
-    Program program;
-    const GLchar* vertex_shader =
-        "#version 150 core\n"
+    // The batched renderers draw one batch per variant, out of the scene order: the
+    // depth of each triangle comes from its index, later triangles in front, and the
+    // depth test keeps the scene order whatever the order of the draws
+    // 2^-22 apart in clip space, two steps of a 24-bit depth buffer, from 1 down to -1 at
+    // triangle 2^23 - 1: the triangles past the first 8M (DEPTH_ORDERED_TRIANGLES) share
+    // the nearest depth and fall back to the order of the draws, reported with F2
+    const std::string triangle_depth =
+        "float triangleDepth(int triangle)"
+        "{"
+        "    return max(1.0 - float(triangle + 1) * exp2(-22.0), -1.0);"
+        "}";
+    // Each variant of the batched renderers is specialized with FILL_VERTEX_COLOR,
+    // FILL_FLAT (none of them blends the two), OUTLINE and TRANSLUCENT, see shaderVariantDefines
+    std::string vertex_shader =
+        "#version 150 core\n" + triangle_depth +
         "in vec2 position;"
         "in vec3 color;"
+        "in vec4 fill;"
+        "in vec4 outline;"
+        "in float selected;"
+        "in float opacity;"
+        "out vec3 f_color;"
+        "out vec3 f_barycentric;"
+        "out vec4 f_outline;"
+        "out float f_opacity;"
+        "uniform mat4 view;"
+        "uniform vec4 selectedOutline;"
+        "uniform int triangleOffset;"
+        "void main()"
+        "{"
+        "    gl_Position = view * vec4(position, 0.0, 1.0);"
+        "    gl_Position.z = triangleDepth(triangleOffset + gl_VertexID / 3);"
+        "    f_opacity = opacity;"
+        "\n#if defined(FILL_VERTEX_COLOR)\n"
+        "    f_color = color;"
+        "\n#elif defined(FILL_FLAT)\n"
+        "    f_color = fill.rgb;"
+        "\n#else\n"
+        "    f_color = mix(color, fill.rgb, fill.a);"
+        "\n#endif\n"
+        "\n#ifdef OUTLINE\n"
+        "    f_outline = mix(outline, selectedOutline, selected);"
+        "    int corner = gl_VertexID % 3;"
+        "    f_barycentric = vec3(corner == 0, corner == 1, corner == 2);"
+        "\n#endif\n"
+        "}";
+    // Same as vertex_shader for the instanced renderer: the shape and the
+    // transform of each triangle are per-instance attributes
+    const GLchar* instanced_vertex_shader =
+        "#version 150 core\n"
+        "in vec2 rest0;"
+        "in vec2 rest1;"
+        "in vec2 rest2;"
+        "in vec3 color0;"
+        "in vec3 color1;"
+        "in vec3 color2;"
+        "in vec4 fill;"
+        "in vec4 outline;"
+        "in float selected;"
+        "in vec2 offset;"
+        "in float angle;"
+        "in float scale;"
         "out vec3 f_color;"
+        "out vec3 f_barycentric;"
+        "out vec4 f_outline;"
         "uniform mat4 view;"
+        "uniform vec4 selectedOutline;"
         "void main()"
         "{"
+        "    int corner = gl_VertexID % 3;"
+        "    vec2 rest = corner == 0 ? rest0 : (corner == 1 ? rest1 : rest2);"
+        "    vec3 color = corner == 0 ? color0 : (corner == 1 ? color1 : color2);"
+        "    float c = cos(angle);"
+        "    float s = sin(angle);"
+        "    vec2 position = offset + scale * vec2(c * rest.x - s * rest.y, s * rest.x + c * rest.y);"
         "    gl_Position = view * vec4(position, 0.0, 1.0);"
-        "    f_color = color; "
+        "    f_color = mix(color, fill.rgb, fill.a);"
+        "    f_outline = mix(outline, selectedOutline, selected);"
+        "    f_barycentric = vec3(corner == 0, corner == 1, corner == 2);"
+        "}";
+    // Same as vertex_shader for the packed vertices, the position is decoded from
+    // the bounds of its chunk, the selection and opacity from the alpha of the color
+    // and the outline is the texel of the triangle, the colors come mixed with the fill
+    std::string packed_vertex_shader =
+        "#version 150 core\n" + triangle_depth +
+        "const int CHUNK_VERTICES = " + std::to_string(CHUNK_TRIANGLES * 3) + ";"
+        "in vec2 position;"
+        "in vec4 color;"
+        "out vec3 f_color;"
+        "out vec3 f_barycentric;"
+        "out vec4 f_outline;"
+        "out float f_opacity;"
+        "uniform mat4 view;"
+        "uniform vec4 selectedOutline;"
+        "uniform samplerBuffer chunks;"
+        "uniform samplerBuffer outlines;"
+        "void main()"
+        "{"
+        "    vec4 chunk = texelFetch(chunks, gl_VertexID / CHUNK_VERTICES);"
+        "    gl_Position = view * vec4(chunk.xy + position * chunk.zw, 0.0, 1.0);"
+        "    gl_Position.z = triangleDepth(gl_VertexID / 3);"
+        "    float alpha = floor(color.a * 255.0 + 0.5);"
+        "    float selected = step(128.0, alpha);"
+        "    f_opacity = (alpha - 128.0 * selected) / 127.0;"
+        "    f_color = color.rgb;"
+        "\n#ifdef OUTLINE\n"
+        "    vec4 outline = texelFetch(outlines, gl_VertexID / 3);"
+        "    f_outline = mix(vec4(outline.rgb, outline.a * 255.0 / 32.0), selectedOutline, selected);"
+        "    int corner = gl_VertexID % 3;"
+        "    f_barycentric = vec3(corner == 0, corner == 1, corner == 2);"
+        "\n#endif\n"
         "}";
+    // The outline is drawn inside the triangle, where the distance in pixels
+    // to the closest edge (derived from the barycentric coordinates) is below its width
+    // Translucent variants write the OIT targets: the color premultiplied by its
+    // alpha and weight with the alpha kept for the revealage, and the weighted alpha
     const GLchar* fragment_shader =
         "#version 150 core\n"
         "in vec3 f_color;"
+        "\n#ifdef OUTLINE\n"
+        "in vec3 f_barycentric;"
+        "in vec4 f_outline;"
+        "\n#endif\n"
+        "\n#ifdef TRANSLUCENT\n"
+        "in float f_opacity;"
+        "out vec4 outWeight;"
+        "\n#endif\n"
         "out vec4 outColor;"
-        "uniform vec3 triangleColor;"
-        "uniform float useTriangleColor=0.0f;"
         "void main()"
         "{"
-        "    if(useTriangleColor > 0) {"
-        "        outColor = vec4(triangleColor, 1.0);"
-        "    } else {"
-        "        outColor = vec4(f_color, 1.0);"
-        "    }"
+        "    vec3 color = f_color;"
+        "\n#ifdef OUTLINE\n"
+        "    vec3 dx = dFdx(f_barycentric);"
+        "    vec3 dy = dFdy(f_barycentric);"
+        "    vec3 pixels = f_barycentric / max(sqrt(dx * dx + dy * dy), vec3(1e-6));"
+        "    float edge = min(min(pixels.x, pixels.y), pixels.z);"
+        "    float coverage = clamp(f_outline.a - edge + 0.5, 0.0, 1.0) * min(f_outline.a, 1.0);"
+        "    color = mix(color, f_outline.rgb, coverage);"
+        "\n#endif\n"
+        "\n#ifdef TRANSLUCENT\n"
+        "    float alpha = clamp(f_opacity, 0.0, 1.0);"
+        "    float weight = clamp(pow(min(1.0, alpha * 10.0) + 0.01, 3.0) * 1e3, 1e-2, 3e3);"
+        "    outColor = vec4(color * alpha * weight, alpha);"
+        "    outWeight = vec4(alpha * weight);"
+        "\n#else\n"
+        "    outColor = vec4(color, 1.0);"
+        "\n#endif\n"
         "}";
 
-
-
     // Compile the two shaders and upload the binary to the GPU
     // Note that we have to explicitly specify that the output "slot" called outColor
     // is the one that we want in the fragment buffer (and thus on screen)
-    program.init(vertex_shader, fragment_shader, "outColor");
-    program.bind();
+    // All the variants share the attribute locations of the layout, and thus the VAO
+    Program programs[SHADER_VARIANTS];
+    Program packedPrograms[SHADER_VARIANTS];
+    // Uniforms updated every frame
+    GLint viewUniforms[SHADER_VARIANTS];
+    // Index of the triangle at vertex 0, non-zero only for the triangles streamed through the ring
+    GLint triangleOffsetUniforms[SHADER_VARIANTS];
+    GLint packedViewUniforms[SHADER_VARIANTS];
+    for (size_t v = 0; v < SHADER_VARIANTS; ++v) {
+        programs[v].init<GpuVertex>(vertex_shader, fragment_shader, "outColor outWeight", shaderVariantDefines(v));
+        programs[v].bind();
+        // Outline of the selected triangles
+        glUniform4f(programs[v].uniform("selectedOutline"), SelectedColor.x, SelectedColor.y, SelectedColor.z, SELECTED_OUTLINE_WIDTH);
+        viewUniforms[v] = programs[v].uniform("view");
+        triangleOffsetUniforms[v] = programs[v].uniform("triangleOffset");
+
+        // The chunk bounds of the packed vertices are a buffer texture on unit 0,
+        // their outlines one on the unit following the OIT targets
+        packedPrograms[v].init<PackedVertex>(packed_vertex_shader, fragment_shader, "outColor outWeight", shaderVariantDefines(v));
+        packedPrograms[v].bind();
+        glUniform4f(packedPrograms[v].uniform("selectedOutline"), SelectedColor.x, SelectedColor.y, SelectedColor.z, SELECTED_OUTLINE_WIDTH);
+        glUniform1i(packedPrograms[v].uniform("chunks"), 0);
+        glUniform1i(packedPrograms[v].uniform("outlines"), 1 + OIT_TARGETS);
+        packedViewUniforms[v] = packedPrograms[v].uniform("view");
+    }
 
-    // The vertex shader wants the position of the vertices as an input.
-    // The following line connects the VBO we defined above with the position "slot"
-    // in the vertex shader
-    program.bindVertexAttribArray("position", VBO);
-    program.bindVertexAttribArray("color", VBO_C);
+    // The layout variant uses every attribute, the layouts are bound through it
+    Program& program = programs[LAYOUT_SHADER_VARIANT];
+    Program& packedProgram = packedPrograms[LAYOUT_SHADER_VARIANT];
+
+    // The vertex shader wants the position and color of the vertices as an input.
+    // The following line connects the interleaved VBO we defined above with the
+    // position and color "slots" in the vertex shader
+    program.bindVertexLayout<GpuVertex>(VBO.id);
+
+    // The streamed triangles have their own VAO, pointed at the region written last
+    VertexArrayObject VAO_Stream;
+    VAO_Stream.init();
+
+    // The instanced renderer has its own VAO, where all the attributes advance once per instance
+    Program instancedProgram;
+    instancedProgram.init(instanced_vertex_shader, fragment_shader, "outColor", "#define OUTLINE\n");
+    instancedProgram.bind();
+    glUniform4f(instancedProgram.uniform("selectedOutline"), SelectedColor.x, SelectedColor.y, SelectedColor.z, SELECTED_OUTLINE_WIDTH);
+    GLint instancedViewUniform = instancedProgram.uniform("view");
+
+    // Merged sub-pixel triangles, square points blended over the background by their coverage
+    // at the depth of the last of their triangles
+    std::string lod_vertex_shader =
+        "#version 150 core\n" + triangle_depth +
+        "in vec2 position;"
+        "in vec4 color;"
+        "in float triangle;"
+        "out vec4 f_color;"
+        "uniform mat4 view;"
+        "void main()"
+        "{"
+        "    gl_Position = view * vec4(position, 0.0, 1.0);"
+        "    gl_Position.z = triangleDepth(int(triangle));"
+        "    f_color = color;"
+        "}";
+    const GLchar* lod_fragment_shader =
+        "#version 150 core\n"
+        "in vec4 f_color;"
+        "out vec4 outColor;"
+        "void main()"
+        "{"
+        "    outColor = f_color;"
+        "}";
+    Program lodProgram;
+    lodProgram.init<LodPoint>(lod_vertex_shader, lod_fragment_shader, "outColor", "");
+    GLint lodViewUniform = lodProgram.uniform("view");
+
+    // Resolve of the translucent triangles, a full screen triangle blending the
+    // average of their colors over the scene by 1 - revealage
+    const GLchar* oit_vertex_shader =
+        "#version 150 core\n"
+        "void main()"
+        "{"
+        "    gl_Position = vec4(gl_VertexID == 1 ? 3.0 : -1.0, gl_VertexID == 2 ? 3.0 : -1.0, 0.0, 1.0);"
+        "}";
+    const GLchar* oit_fragment_shader =
+        "#version 150 core\n"
+        "uniform sampler2D accumulation;"
+        "uniform sampler2D weight;"
+        "out vec4 outColor;"
+        "void main()"
+        "{"
+        "    ivec2 pixel = ivec2(gl_FragCoord.xy);"
+        "    vec4 accumulated = texelFetch(accumulation, pixel, 0);"
+        "    float revealage = accumulated.a;"
+        "    if (revealage >= 1.0) discard;"
+        "    vec3 average = accumulated.rgb / max(texelFetch(weight, pixel, 0).r, 1e-5);"
+        "    outColor = vec4(average, revealage);"
+        "}";
+    Program oitProgram;
+    oitProgram.init(oit_vertex_shader, oit_fragment_shader, "outColor");
+    oitProgram.bind();
+    // Unit 0 holds the chunk bounds of the packed vertices
+    glUniform1i(oitProgram.uniform("accumulation"), 1 + OIT_ACCUMULATION);
+    glUniform1i(oitProgram.uniform("weight"), 1 + OIT_WEIGHT);
+
+    // ID buffer of the GPU picking, the index + 1 of the triangle of each vertex, 0 where there is none
+    // The packed vertices decode their position as in packed_vertex_shader, the LOD points
+    // take the index of their last triangle, all at the same depth as on screen
+    std::string id_vertex_shader =
+        "#version 150 core\n" + triangle_depth +
+        "const int CHUNK_VERTICES = " + std::to_string(CHUNK_TRIANGLES * 3) + ";"
+        "in vec2 position;"
+        "\n#ifdef LOD_POINT\n"
+        "in float triangle;"
+        "\n#endif\n"
+        "flat out uint f_id;"
+        "uniform mat4 view;"
+        "uniform samplerBuffer chunks;"
+        "uniform int triangleOffset;"
+        "void main()"
+        "{"
+        "\n#ifdef PACKED\n"
+        "    vec4 chunk = texelFetch(chunks, gl_VertexID / CHUNK_VERTICES);"
+        "    gl_Position = view * vec4(chunk.xy + position * chunk.zw, 0.0, 1.0);"
+        "\n#else\n"
+        "    gl_Position = view * vec4(position, 0.0, 1.0);"
+        "\n#endif\n"
+        "\n#ifdef LOD_POINT\n"
+        "    int id = int(triangle);"
+        "\n#elif defined(PACKED)\n"
+        "    int id = gl_VertexID / 3;"
+        "\n#else\n"
+        "    int id = triangleOffset + gl_VertexID / 3;"
+        "\n#endif\n"
+        "    gl_Position.z = triangleDepth(id);"
+        "    f_id = uint(id + 1);"
+        "}";
+    const GLchar* id_fragment_shader =
+        "#version 150 core\n"
+        "flat in uint f_id;"
+        "out uint outId;"
+        "void main()"
+        "{"
+        "    outId = f_id;"
+        "}";
+    Program idProgram;
+    idProgram.init<GpuVertex>(id_vertex_shader, id_fragment_shader, "outId", "");
+    GLint idViewUniform = idProgram.uniform("view");
+    GLint idTriangleOffsetUniform = idProgram.uniform("triangleOffset");
+    Program packedIdProgram;
+    packedIdProgram.init<PackedVertex>(id_vertex_shader, id_fragment_shader, "outId", "#define PACKED\n");
+    packedIdProgram.bind();
+    glUniform1i(packedIdProgram.uniform("chunks"), 0);
+    GLint packedIdViewUniform = packedIdProgram.uniform("view");
+    Program lodIdProgram;
+    lodIdProgram.init<LodPoint>(id_vertex_shader, id_fragment_shader, "outId", "#define LOD_POINT\n");
+    GLint lodIdViewUniform = lodIdProgram.uniform("view");
+    IdReadback.init();
+    const std::vector<GLenum> idFormats(1, GL_R32UI);
+
+    printf("Shader cache: %u hits, %u misses\n", Program::binary_cache_hits, Program::binary_cache_misses);
+
+    // The packed vertices have their own VAO too
+    VertexArrayObject VAO_Packed;
+    VAO_Packed.init();
+    VAO_Packed.bind();
+    VBO_Packed.init();
+    VBO_Chunks.init();
+    VBO_Chunks.reserve(sizeof(glm::vec4));
+    ChunkTexture.init(GL_RGBA32F, VBO_Chunks.id);
+    VBO_Outlines.init();
+    VBO_Outlines.reserve(sizeof(glm::u8vec4));
+    OutlineTexture.init(GL_RGBA8, VBO_Outlines.id);
+    packedProgram.bindVertexLayout<PackedVertex>(VBO_Packed.id);
+
+    VertexArrayObject VAO_Instanced;
+    VAO_Instanced.init();
+    VAO_Instanced.bind();
+    VBO_Shapes.init();
+    VBO_Transforms.init();
+    instancedProgram.bindVertexLayout<GpuShape>(VBO_Shapes.id, 0, 1);
+    instancedProgram.bindVertexLayout<GpuTransform>(VBO_Transforms.id, 0, 1);
+
+    VertexArrayObject VAO_Lod;
+    VAO_Lod.init();
+    VAO_Lod.bind();
+    VBO_Lod.init();
+    VBO_Lod.reserve(sizeof(LodPoint));
+    lodProgram.bindVertexLayout<LodPoint>(VBO_Lod.id);
+
+    // OIT targets, (re)created at the size of the framebuffer the first time translucent triangles are drawn
+    // In full float: with weights up to 3e3, a few overlapping triangles already overflow half floats
+    // (65504) to inf, and the resolve divides inf by inf
+    TextureFramebuffer oitTargets;
+    std::vector<GLenum> oitFormats(OIT_TARGETS);
+    oitFormats[OIT_ACCUMULATION] = GL_RGBA32F;
+    oitFormats[OIT_WEIGHT] = GL_R32F;
+
+    // Equal depths keep the order of the draws
+    glDepthFunc(GL_LEQUAL);
+
+    FramebufferObject offscreen;
+    if (options.headless) {
+        if (!offscreen.init(options.width, options.height)) {
+            fprintf(stderr, "Error: the %dx%d offscreen framebuffer is incomplete\n", options.width, options.height);
+            glfwTerminate();
+            return -1;
+        }
+        offscreen.bind();
+    }
 
     // Save the current time --- it will be used to dynamically change the triangle color
     auto t_start = std::chrono::high_resolution_clock::now();
+    size_t frame = 0;
 
     // Register the keyboard callback
     glfwSetKeyCallback(window, key_callback);
@@ -854,22 +2609,15 @@ int main(void)
 
     // Update viewport
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
-    float dt = 0, prev = 0;
+    float dt = 0, prev = 0, statsTime = 0;
     // Loop until the user closes the window
     while (!glfwWindowShouldClose(window))
     {
-        // Bind your VAO (not necessary if you have only one)
-        VAO.bind();
-
-        // Bind your program
-        program.bind();
-
         // Set the uniform value depending on the time difference
         auto t_now = std::chrono::high_resolution_clock::now();
         float time = std::chrono::duration_cast<std::chrono::duration<float>>(t_now - t_start).count();
-        glUniform1f(program.uniform("useTriangleColor"), 0.0f);
-        glUniform3f(program.uniform("triangleColor"), 0.0f, 0.0f, 0.0f);//(float)(sin(time * 4.0f) + 1.0f) / 2.0f, 0.0f, 0.0f);
 
         
         dt = (time - prev);
@@ -879,87 +2627,378 @@ int main(void)
         if (dt >= ANIMATION_STEP) {
             dt = 0;
             prev = time;
-            if (curMode == AppMode::ANIMATION && AnimationInProgress == 3 && AnimationTimeout > 0) {
+            if (isAnimating()) {
                 runAnimation();
             }
         }
 
         // Get size of the window
-        int width, height;
-        glfwGetWindowSize(window, &width, &height);
-        float aspect_ratio = float(height) / float(width); // corresponds to the necessary width scaling
+        int width = offscreen.width, height = offscreen.height;
+        if (!options.headless)
+            glfwGetWindowSize(window, &width, &height);
+        view = sceneView(width, height);
 
+        // Clear the framebuffer
+        glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Upload the triangles edited since the last frame
+        size_t frameBytes = sceneSync.flush(view, height);
+
+        if (InstancedRendering) {
+            // The instances are drawn in scene order by a single draw
+            GLState::current().enable(GL_DEPTH_TEST, false);
+            VAO_Instanced.bind();
+            instancedProgram.bind();
+            glUniformMatrix4fv(instancedViewUniform, 1, GL_FALSE, glm::value_ptr(view));
+
+            // Every triangle is an instance of the same 3 vertices
+            if (!triangles.empty()) {
+                glDrawArraysInstanced(GL_TRIANGLES, 0, 3, triangles.size());
+                stats.drawCalls++;
+            }
 
-        view = glm::scale(glm::mat4(1.f), glm::vec3(aspect_ratio * ZoomFactor, ZoomFactor, 1.0f));
-        view = glm::translate(view, glm::vec3(SceneOffsetX, SceneOffsetY, 0.0f));
+            // Point the instance attributes at the triangle being inserted to draw its edge
+            if (!triangles.empty() && !triangles.back().isComplete()) {
+                size_t last = triangles.size() - 1;
+                instancedProgram.bindVertexLayout<GpuShape>(VBO_Shapes.id, last * sizeof(GpuShape), 1);
+                instancedProgram.bindVertexLayout<GpuTransform>(VBO_Transforms.id, last * sizeof(GpuTransform), 1);
+                glDrawArrays(GL_LINES, 0, 2);
+                stats.drawCalls++;
+                instancedProgram.bindVertexLayout<GpuShape>(VBO_Shapes.id, 0, 1);
+                instancedProgram.bindVertexLayout<GpuTransform>(VBO_Transforms.id, 0, 1);
+            }
+        } else {
+            Program* variants = PackedVertices ? packedPrograms : programs;
+            GLint* variantViewUniforms = PackedVertices ? packedViewUniforms : viewUniforms;
+            if (PackedVertices) {
+                VAO_Packed.bind();
+                ChunkTexture.bind(0);
+                OutlineTexture.bind(1 + OIT_TARGETS);
+            } else {
+                // The triangles streamed through the ring are read from the region written last
+                if (!StreamedBatches.empty()) {
+                    VAO_Stream.bind();
+                    program.bindVertexLayout<GpuVertex>(VBO_Stream.id, StreamedOffset);
+                }
 
+                // Bind your VAO (not necessary if you have only one)
+                VAO.bind();
+            }
 
-        glUniformMatrix4fv(program.uniform("view"), 1, GL_FALSE, glm::value_ptr(view));
+            // Draw the streamed runs of the variants [first, last) from the ring, their
+            // triangle offset gives them the depth of their place in the scene
+            auto drawStreamed = [&](size_t first, size_t last) {
+                if (PackedVertices || StreamedBatches.empty()) return;
+                VAO_Stream.bind();
+                for (size_t k = 0; k < StreamedBatches.size(); ++k) {
+                    const StreamedBatch& batch = StreamedBatches[k];
+                    if (batch.variant < first || batch.variant >= last) continue;
+                    programs[batch.variant].bind();
+                    glUniformMatrix4fv(viewUniforms[batch.variant], 1, GL_FALSE, glm::value_ptr(view));
+                    glUniform1i(triangleOffsetUniforms[batch.variant], batch.triangle - batch.first / 3);
+                    glDrawArrays(GL_TRIANGLES, batch.first, batch.count);
+                    glUniform1i(triangleOffsetUniforms[batch.variant], 0);
+                    stats.drawCalls++;
+                }
+                VAO.bind();
+            };
+
+            // Fill and outline the visible opaque triangles with one draw per variant,
+            // the colors, outline width and selection come with the vertices (the outline
+            // of the packed ones from OutlineTexture), their depth keeps the scene order
+            GLState::current().enable(GL_DEPTH_TEST, true);
+            bool translucent = false;
+            for (size_t v = 0; v < SHADER_VARIANTS; ++v) {
+                const VariantBatch& batch = VariantBatches[v];
+                if (batch.first.empty()) continue;
+                if (v >= OPAQUE_SHADER_VARIANTS) {
+                    translucent = true;
+                    continue;
+                }
+                variants[v].bind();
+                glUniformMatrix4fv(variantViewUniforms[v], 1, GL_FALSE, glm::value_ptr(view));
+                glMultiDrawArrays(GL_TRIANGLES, batch.first.data(), batch.count.data(), batch.first.size());
+                stats.drawCalls++;
+            }
+            drawStreamed(0, OPAQUE_SHADER_VARIANTS);
+            for (size_t k = 0; k < StreamedBatches.size(); ++k) {
+                translucent = translucent || StreamedBatches[k].variant >= OPAQUE_SHADER_VARIANTS;
+            }
 
-        // Clear the framebuffer
-        glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
+            // Then the translucent ones in any order, accumulated off screen and
+            // composited over the opaque triangles, no sorting needed
+            // The opaque triangles are drawn again into the depth buffer of the OIT
+            // targets only, so that the ones after a translucent triangle still cover it
+            if (translucent) {
+                int targetWidth = offscreen.width, targetHeight = offscreen.height;
+                if (!options.headless)
+                    glfwGetFramebufferSize(window, &targetWidth, &targetHeight);
+                if (oitTargets.width != targetWidth || oitTargets.height != targetHeight) {
+                    oitTargets.free();
+                    if (!oitTargets.init(targetWidth, targetHeight, oitFormats, true))
+                        fprintf(stderr, "Error: the %dx%d OIT framebuffer is incomplete\n", targetWidth, targetHeight);
+                }
 
-        if (V.size() < triangles.size() * 3) V.resize(triangles.size() * 3);
-        if (C.size() < triangles.size() * 3) C.resize(triangles.size() * 3);
+                GLState& state = GLState::current();
+                oitTargets.bind();
+                const GLfloat clearAccumulation[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+                const GLfloat clearWeight[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                glClearBufferfv(GL_COLOR, OIT_ACCUMULATION, clearAccumulation);
+                glClearBufferfv(GL_COLOR, OIT_WEIGHT, clearWeight);
+                const GLfloat clearDepth = 1.0f;
+                glClearBufferfv(GL_DEPTH, 0, &clearDepth);
+
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                for (size_t v = 0; v < OPAQUE_SHADER_VARIANTS; ++v) {
+                    const VariantBatch& batch = VariantBatches[v];
+                    if (batch.first.empty()) continue;
+                    variants[v].bind();
+                    glMultiDrawArrays(GL_TRIANGLES, batch.first.data(), batch.count.data(), batch.first.size());
+                    stats.drawCalls++;
+                }
+                drawStreamed(0, OPAQUE_SHADER_VARIANTS);
+                glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+                // Sums of the colors and weights, product of the transparencies in the alpha
+                // The translucent triangles are tested against the depth but do not hide each other
+                glDepthMask(GL_FALSE);
+                state.enable(GL_BLEND, true);
+                state.blendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+                for (size_t v = OPAQUE_SHADER_VARIANTS; v < SHADER_VARIANTS; ++v) {
+                    const VariantBatch& batch = VariantBatches[v];
+                    if (batch.first.empty()) continue;
+                    variants[v].bind();
+                    glUniformMatrix4fv(variantViewUniforms[v], 1, GL_FALSE, glm::value_ptr(view));
+                    glMultiDrawArrays(GL_TRIANGLES, batch.first.data(), batch.count.data(), batch.first.size());
+                    stats.drawCalls++;
+                }
+                drawStreamed(OPAQUE_SHADER_VARIANTS, SHADER_VARIANTS);
+
+                // Back to the scene, the resolve weighs the average color by 1 - revealage
+                if (options.headless) {
+                    offscreen.bind();
+                } else {
+                    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                    glViewport(0, 0, targetWidth, targetHeight);
+                }
+                oitTargets.bindTextures(1);
+                oitProgram.bind();
+                state.blendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+                state.enable(GL_DEPTH_TEST, false);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+                state.enable(GL_DEPTH_TEST, true);
+                state.enable(GL_BLEND, false);
+                glDepthMask(GL_TRUE);
+                stats.drawCalls++;
+            }
 
-        for (size_t i = 0; i < triangles.size(); ++i) {
-            glm::vec3 fill = triangles[i].fillColor;
-            glm::vec3 outline = triangles[i].outlineColor;
+            // Then the merged sub-pixel triangles, each cell as one point behind the
+            // triangles that follow its own
+            if (!LodPoints.empty()) {
+                GLState& state = GLState::current();
+                VAO_Lod.bind();
+                lodProgram.bind();
+                glUniformMatrix4fv(lodViewUniform, 1, GL_FALSE, glm::value_ptr(view));
+                glPointSize(LOD_CELL_PIXELS);
+                state.enable(GL_BLEND, true);
+                state.blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+                glDrawArrays(GL_POINTS, 0, LodPoints.size());
+                state.enable(GL_BLEND, false);
+                stats.drawCalls++;
+                if (PackedVertices) VAO_Packed.bind(); else VAO.bind();
+            }
 
-            if (triangles[i].isComplete()) {
-                V[i * 3 + 0] = triangles[i][0].vertex;
-                V[i * 3 + 1] = triangles[i][1].vertex;
-                V[i * 3 + 2] = triangles[i][2].vertex;
-
-                C[i * 3 + 0] = triangles[i][0].color;
-                C[i * 3 + 1] = triangles[i][1].color;
-                C[i * 3 + 2] = triangles[i][2].color;
-
-                VBO.update(V);
-                VBO_C.update(C);
-                
-                glUniform3f(program.uniform("triangleColor"), fill.x, fill.y, fill.z);
-                glDrawArrays(GL_TRIANGLES, i * 3, 3);
-
-                if (selectedTriangle == &triangles[i] || animationStartTriangle == &triangles[i] || animationFinalTriangle == &triangles[i]) {
-                    glUniform3f(program.uniform("triangleColor"), SelectedColor.x, SelectedColor.y, SelectedColor.z);
-                    glLineWidth(3);
-                } else {                    
-                    glUniform3f(program.uniform("triangleColor"), outline.x, outline.y, outline.z);
-                    glLineWidth(1);
-                }
-                
-                glUniform1f(program.uniform("useTriangleColor"), 1.0f);
-                glDrawArrays(GL_LINE_LOOP, i * 3, 3);
-                glUniform1f(program.uniform("useTriangleColor"), 0.0f);
-            } else {
-                V[i * 3 + 0] = triangles[i][0].vertex;
-                V[i * 3 + 1] = triangles[i][1].vertex;
+            // The triangle being inserted is a single edge until its third vertex is placed
+            if (!triangles.empty() && !triangles.back().isComplete()) {
+                variants[FULL_SHADER_VARIANT].bind();
+                glUniformMatrix4fv(variantViewUniforms[FULL_SHADER_VARIANT], 1, GL_FALSE, glm::value_ptr(view));
+                glDrawArrays(GL_LINES, (triangles.size() - 1) * 3, 2);
+                stats.drawCalls++;
+            }
 
-                C[i * 3 + 0] = triangles[i][0].color;
-                C[i * 3 + 1] = triangles[i][1].color;
+            // The ID buffer is drawn again only once the scene or the view changed, with the
+            // same batches and points at the same depths so that the triangle on top is the
+            // one on screen, a point picks the last of its triangles
+            // The edge of the triangle being inserted is not picked
+            if (GpuPicking && !options.headless) {
+                int targetWidth, targetHeight;
+                glfwGetFramebufferSize(window, &targetWidth, &targetHeight);
+                if (IdBuffer.width != targetWidth || IdBuffer.height != targetHeight) {
+                    IdBuffer.free();
+                    IdBufferValid = false;
+                    if (!IdBuffer.init(targetWidth, targetHeight, idFormats, true))
+                        fprintf(stderr, "Error: the %dx%d ID framebuffer is incomplete\n", targetWidth, targetHeight);
+                }
 
-                VBO.update(V);
-                VBO_C.update(C);
+                if (!IdBufferValid || IdBufferRevision != sceneSync.revision() || IdBufferView != view) {
+                    IdBuffer.bind();
+                    const GLuint clearId[4] = { 0, 0, 0, 0 };
+                    glClearBufferuiv(GL_COLOR, 0, clearId);
+                    const GLfloat clearDepth = 1.0f;
+                    glClearBufferfv(GL_DEPTH, 0, &clearDepth);
+                    GLState::current().enable(GL_DEPTH_TEST, true);
+                    Program& idVariant = PackedVertices ? packedIdProgram : idProgram;
+                    idVariant.bind();
+                    glUniformMatrix4fv(PackedVertices ? packedIdViewUniform : idViewUniform, 1, GL_FALSE, glm::value_ptr(view));
+                    for (size_t v = 0; v < SHADER_VARIANTS; ++v) {
+                        const VariantBatch& batch = VariantBatches[v];
+                        if (batch.first.empty()) continue;
+                        glMultiDrawArrays(GL_TRIANGLES, batch.first.data(), batch.count.data(), batch.first.size());
+                        stats.drawCalls++;
+                    }
+                    if (!PackedVertices && !StreamedBatches.empty()) {
+                        VAO_Stream.bind();
+                        for (size_t k = 0; k < StreamedBatches.size(); ++k) {
+                            const StreamedBatch& batch = StreamedBatches[k];
+                            glUniform1i(idTriangleOffsetUniform, batch.triangle - batch.first / 3);
+                            glDrawArrays(GL_TRIANGLES, batch.first, batch.count);
+                            stats.drawCalls++;
+                        }
+                        glUniform1i(idTriangleOffsetUniform, 0);
+                        VAO.bind();
+                    }
+                    if (!LodPoints.empty()) {
+                        VAO_Lod.bind();
+                        lodIdProgram.bind();
+                        glUniformMatrix4fv(lodIdViewUniform, 1, GL_FALSE, glm::value_ptr(view));
+                        glDrawArrays(GL_POINTS, 0, LodPoints.size());
+                        stats.drawCalls++;
+                    }
+                    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                    glViewport(0, 0, targetWidth, targetHeight);
+
+                    IdBufferView = view;
+                    IdBufferRevision = sceneSync.revision();
+                    IdBufferValid = true;
+                    IdReadback.discard();
+
+                    // Start reading the pixel under the cursor right away
+                    double xpos, ypos;
+                    glfwGetCursorPos(window, &xpos, &ypos);
+                    glm::vec4 cursor = glm::inverse(view) * glm::vec4((xpos / width) * 2 - 1, ((height - 1 - ypos) / height) * 2 - 1, 0, 1);
+                    requestPick(glm::vec2(cursor.x, cursor.y));
+                }
+            }
+        }
 
-                glDrawArrays(GL_LINES, i * 3, 2);
+        // Fence the region the streamed triangles were read from, moving on to the next one once written
+        if (!InstancedRendering && !PackedVertices && !StreamedBatches.empty()) {
+            if (StreamedRegionWritten) VBO_Stream.advance(); else VBO_Stream.retain();
+        }
+        StreamedRegionWritten = false;
+
+        stats.frames++;
+        stats.bytesUploaded += frameBytes;
+        stats.peakBytesUploaded = std::max(stats.peakBytesUploaded, frameBytes);
+        if (time - statsTime >= 1.0f) {
+            if (ShowStats) {
+                GLState& state = GLState::current();
+                printf("[stats] %zu frames, %zu bytes uploaded (%zu/frame, peak %zu), %zu draw calls/frame, %u stream stalls\n",
+                    stats.frames, stats.bytesUploaded, stats.bytesUploaded / stats.frames, stats.peakBytesUploaded,
+                    stats.drawCalls / stats.frames, VBO_Stream.stalls);
+                printf("[stats] GL state changes: %zu issued, %zu elided per frame\n",
+                    state.issued / stats.frames, state.elided / stats.frames);
+                printf("[stats] %zu visible of %zu triangles, %zu at full detail (%zu without outline), %zu merged into %zu points\n",
+                    sceneSync.visibleCount(), triangles.size(), sceneSync.detailedCount(), sceneSync.outlinesDroppedCount(),
+                    sceneSync.visibleCount() - sceneSync.detailedCount(), InstancedRendering ? 0 : LodPoints.size());
+                if (triangles.size() > DEPTH_ORDERED_TRIANGLES) {
+                    printf("[stats] %zu triangles past the %zu with a depth of their own, drawn out of scene order\n",
+                        triangles.size() - DEPTH_ORDERED_TRIANGLES, DEPTH_ORDERED_TRIANGLES);
+                }
+                if (BvhIndex) {
+                    Bvh& bvh = sceneSync.boundsHierarchy();
+                    printf("[stats] BVH: %zu nodes, %zu pending, %zu queries visiting %zu nodes and testing %zu boxes, %zu refits, %zu rebuilds\n",
+                        bvh.nodes(), bvh.pendingItems(), bvh.stats.queries, bvh.stats.nodesVisited, bvh.stats.itemsTested,
+                        bvh.stats.refits, bvh.stats.rebuilds);
+                    bvh.stats = Bvh::Stats();
+                }
+                if (GpuPicking) {
+                    printf("[stats] GPU picking: %u waits for a readback\n", IdReadback.stalls);
+                }
+                if (PackedVertices && !InstancedRendering) {
+                    // The view maps one world unit to ZoomFactor * height / 2 pixels
+                    float measured, bound;
+                    packedPrecision(measured, bound);
+                    float pixels = ZoomFactor * height * 0.5f;
+                    // Compared to float positions and colors, and to the full GpuVertex of the float path
+                    printf("[stats] packed vertices: %zu bytes (%zu as float positions and colors, %zu as GpuVertex), quantization error %.4f px, bounded by %.4f px\n",
+                        PackedV.size() * sizeof(PackedVertex) + PackedOutlines.size() * sizeof(glm::u8vec4) + PackedChunks.size() * sizeof(glm::vec4),
+                        PackedV.size() * (sizeof(glm::vec2) + sizeof(glm::vec3)), PackedV.size() * sizeof(GpuVertex),
+                        measured * pixels, bound * pixels);
+                }
             }
-            
+            GLState::current().resetCounters();
+            stats = FrameStats();
+            statsTime = time;
+        }
+
+        // Headless frames are rendered back to back, without presentation or events
+        if (options.headless) {
+            if (++frame >= options.frames)
+                glfwSetWindowShouldClose(window, GLFW_TRUE);
+            continue;
         }
 
         // Swap front and back buffers
         glfwSwapBuffers(window);
 
-        // Poll for and process events
-        glfwPollEvents();
+        // Keep rendering while an animation runs, otherwise sleep until
+        // an input event or an edit of the scene calls for a new frame
+        RedrawRequested = false;
+        if (isAnimating()) {
+            glfwPollEvents();
+        } else {
+            while (!RedrawRequested && !sceneSync.isDirty() && !glfwWindowShouldClose(window)) {
+                glfwWaitEvents();
+            }
+        }
+    }
+
+    if (options.headless) {
+        glFinish();
+        float seconds = std::chrono::duration_cast<std::chrono::duration<float>>(std::chrono::high_resolution_clock::now() - t_start).count();
+        printf("Rendered %zu frames of %dx%d with %zu triangles (%zu visible) in %.3f s (%.3f ms/frame) on %s\n",
+            frame, offscreen.width, offscreen.height, triangles.size(), sceneSync.visibleCount(), seconds, seconds * 1000.0f / frame,
+            (const char*) glGetString(GL_RENDERER));
+
+        if (!options.dump.empty()) {
+            std::vector<unsigned char> rgb;
+            offscreen.readPixels(rgb);
+            if (!write_ppm(options.dump, offscreen.width, offscreen.height, rgb))
+                fprintf(stderr, "Error: could not write %s\n", options.dump.c_str());
+        }
+        offscreen.free();
     }
 
     // Deallocate opengl memory
-    program.free();
+    for (size_t v = 0; v < SHADER_VARIANTS; ++v) {
+        programs[v].free();
+        packedPrograms[v].free();
+    }
+    instancedProgram.free();
+    lodProgram.free();
+    oitProgram.free();
+    oitTargets.free();
+    idProgram.free();
+    packedIdProgram.free();
+    lodIdProgram.free();
+    IdBuffer.free();
+    IdReadback.free();
     VAO.free();
+    VAO_Instanced.free();
+    VAO_Packed.free();
+    VAO_Lod.free();
+    VBO_Lod.free();
+    VBO_Packed.free();
+    VBO_Chunks.free();
+    ChunkTexture.free();
+    VBO_Outlines.free();
+    OutlineTexture.free();
     VBO.free();
-    VBO_C.free();
+    VBO_Stream.free();
+    VBO_Shapes.free();
+    VBO_Transforms.free();
 
     // Deallocate glfw internals
     glfwTerminate();
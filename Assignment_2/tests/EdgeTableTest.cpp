@@ -0,0 +1,170 @@
+// Checks the edge table against a reference in double precision, built once with
+// SSE2 and once with the scalar Float4 (SIMD_SCALAR), see CMakeLists.txt
+#include "EdgeTable.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, glm::vec2 p)
+{
+    if (ok)
+        return;
+    printf("FAILED: %s at (%.9g, %.9g)\n", what, p.x, p.y);
+    failures++;
+}
+
+// Signed distance of p to the closest edge, in double, negative outside
+static double distance(const EdgeTable::Edges& edges, glm::vec2 p)
+{
+    double d = INFINITY;
+    for (int k = 0; k < 3; ++k)
+        d = std::min(d, double(edges.a[k]) * p.x + double(edges.b[k]) * p.y + double(edges.c[k]));
+    return d;
+}
+
+// Rounding, or fused multiply-adds, can move a point within eps of an edge to either side
+static bool agrees(bool inside, double d, double eps)
+{
+    return d >= eps ? inside : (d <= -eps ? !inside : true);
+}
+
+// Every way to test the triangle 'id' of the table, which has to be the one of 'edges'
+static void checkPoint(const EdgeTable& table, unsigned id, const EdgeTable::Edges& edges, glm::vec2 p, bool expected, const char* what)
+{
+    check(EdgeTable::contains(edges, p) == expected, what, p);
+    check(table.contains(id, p) == expected, what, p);
+
+    std::vector<unsigned> out;
+    table.containing(p, id, id + 1, out);
+    check(out.size() == (expected ? 1u : 0u), what, p);
+
+    std::vector<unsigned> ids(1, id);
+    table.filter(p, ids);
+    check(ids.size() == (expected ? 1u : 0u), what, p);
+}
+
+static void testBoundaries()
+{
+    EdgeTable table;
+    struct Case
+    {
+        glm::vec2 p0, p1, p2;
+        glm::vec2 point;
+        bool inside;
+        const char* what;
+    };
+    const Case cases[] = {
+        // Horizontal edges in both windings, the boundary is inside
+        { glm::vec2(0, 0), glm::vec2(4, 0), glm::vec2(2, 3), glm::vec2(1, 0), true, "point on a horizontal edge" },
+        { glm::vec2(0, 0), glm::vec2(2, 3), glm::vec2(4, 0), glm::vec2(3, 0), true, "point on a horizontal edge, clockwise" },
+        { glm::vec2(0, 0), glm::vec2(4, 0), glm::vec2(2, 3), glm::vec2(2, -1e-4f), false, "point below a horizontal edge" },
+        { glm::vec2(0, 2), glm::vec2(4, 2), glm::vec2(2, -1), glm::vec2(2, 2), true, "point on a horizontal top edge" },
+        { glm::vec2(0, 2), glm::vec2(4, 2), glm::vec2(2, -1), glm::vec2(2, 2.0001f), false, "point above a horizontal top edge" },
+        // Vertical and diagonal edges, exact in float
+        { glm::vec2(0, 0), glm::vec2(0, 4), glm::vec2(3, 2), glm::vec2(0, 1), true, "point on a vertical edge" },
+        { glm::vec2(0, 0), glm::vec2(2, 2), glm::vec2(2, 0), glm::vec2(1, 1), true, "point on a diagonal edge" },
+        { glm::vec2(0, 0), glm::vec2(2, 2), glm::vec2(2, 0), glm::vec2(1, 1.0001f), false, "point past a diagonal edge" },
+        { glm::vec2(0, 0), glm::vec2(4, 0), glm::vec2(2, 3), glm::vec2(2, 1), true, "point inside" },
+        // Degenerate triangles contain no point, not even their own vertices
+        { glm::vec2(0, 0), glm::vec2(1, 1), glm::vec2(2, 2), glm::vec2(1, 1), false, "collinear triangle" },
+        { glm::vec2(1, 1), glm::vec2(1, 1), glm::vec2(1, 1), glm::vec2(1, 1), false, "triangle reduced to a point" },
+        { glm::vec2(0, 0), glm::vec2(4, 0), glm::vec2(4, 0), glm::vec2(2, 0), false, "triangle reduced to a segment" },
+        { glm::vec2(0, 0), glm::vec2(NAN, 0), glm::vec2(2, 3), glm::vec2(1, 1), false, "triangle with a NaN vertex" },
+    };
+
+    for (unsigned id = 0; id < sizeof(cases) / sizeof(cases[0]); ++id)
+    {
+        const Case& c = cases[id];
+        table.update(id, c.p0, c.p1, c.p2);
+        checkPoint(table, id, EdgeTable::edges(c.p0, c.p1, c.p2), c.point, c.inside, c.what);
+    }
+
+    // Cleared triangles and the ones added by resize() contain no point
+    table.clear(8);
+    checkPoint(table, 8, EdgeTable::edges(glm::vec2(0.0f), glm::vec2(0.0f), glm::vec2(0.0f)), glm::vec2(2, 1), false, "cleared triangle");
+    table.resize(3);
+    table.resize(9);
+    checkPoint(table, 8, EdgeTable::edges(glm::vec2(0.0f), glm::vec2(0.0f), glm::vec2(0.0f)), glm::vec2(2, 1), false, "triangle added by resize");
+}
+
+static void testRandom()
+{
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> coordinate(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> offset(-5.0f, 5.0f);
+
+    const size_t count = 1003;
+    EdgeTable table;
+    std::vector<EdgeTable::Edges> edges(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        glm::vec2 p0(coordinate(random), coordinate(random));
+        glm::vec2 p1 = p0 + glm::vec2(offset(random), offset(random));
+        glm::vec2 p2 = p0 + glm::vec2(offset(random), offset(random));
+        // Some horizontal and degenerate ones among them
+        if (i % 7 == 0)
+            p1.y = p0.y;
+        if (i % 11 == 0)
+            p2 = p0 + (p1 - p0) * 0.5f;
+        table.update(i, p0, p1, p2);
+        edges[i] = EdgeTable::edges(p0, p1, p2);
+    }
+
+    const double eps = 1e-4;
+    for (int q = 0; q < 2000; ++q)
+    {
+        glm::vec2 p(coordinate(random), coordinate(random));
+
+        // Ranges that start and end inside a block
+        size_t first = random() % count;
+        size_t last = first + random() % (count - first + 1);
+        std::vector<unsigned> out;
+        table.containing(p, first, last, out);
+        check(std::is_sorted(out.begin(), out.end()), "containing is sorted", p);
+
+        std::vector<unsigned> ids;
+        for (size_t i = first; i < last; ++i)
+        {
+            double d = distance(edges[i], p);
+            bool listed = std::binary_search(out.begin(), out.end(), unsigned(i));
+            check(agrees(listed, d, eps), "containing against the reference", p);
+            check(agrees(table.contains(i, p), d, eps), "contains against the reference", p);
+            if (random() % 2)
+                ids.push_back(i);
+        }
+        check(out.empty() || (out.front() >= first && out.back() < last), "containing stays in its range", p);
+
+        // Ids in any order, the kept ones in the same order
+        std::shuffle(ids.begin(), ids.end(), random);
+        std::vector<unsigned> kept(ids);
+        table.filter(p, kept);
+        size_t k = 0;
+        for (size_t j = 0; j < ids.size(); ++j)
+        {
+            bool listed = k < kept.size() && kept[k] == ids[j];
+            if (listed)
+                k++;
+            check(agrees(listed, distance(edges[ids[j]], p), eps), "filter against the reference", p);
+        }
+        check(k == kept.size(), "filter keeps the order", p);
+    }
+}
+
+int main()
+{
+#ifdef SIMD_SSE2
+    printf("Float4: SSE2\n");
+#else
+    printf("Float4: scalar\n");
+#endif
+    testBoundaries();
+    testRandom();
+    printf("%d failures\n", failures);
+    return failures == 0 ? 0 : 1;
+}